@@ -0,0 +1,399 @@
+/* async_log.h
+   Asynchronous, structured logging for the motor controllers. Header only, like motor_model.h.
+
+   A log call never blocks and never takes a lock. Each thread gets its own single-producer ring
+   the first time it logs. The call copies the format pointer and its raw arguments into the
+   ring; %s arguments are copied into the record too. A background flusher thread does the
+   formatting and all the stdio work, so a slow terminal or pipe only ever stalls the flusher.
+   When a ring is full the record is dropped and counted, and the flusher reports the drops.
+
+   Formats must be string literals. They support the usual printf conversions (d i u x X o c
+   s p f e g a, with h l ll z j t lengths) but not '*' widths. Records are merged across threads
+   in call order, filtered by level at the call site, and written as text or JSON lines. log_warn
+   and log_error are rate limited per call site: a few per second, then a count of what was
+   suppressed. The count comes with the site's next line, or from the flusher once a second if
+   the site has gone quiet, so a burst followed by silence is still accounted for.
+*/
+
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define LOG_MAX_THREADS 32
+#define LOG_RING_RECORDS 256     // per thread, power of two
+#define LOG_MAX_ARGS 10
+#define LOG_STR_BYTES 256        // %s arguments of one record, copied
+#define LOG_THREAD_NAME_SIZE 16
+#define LOG_LINE_SIZE 1024
+#define LOG_FLUSH_MS 20
+#define LOG_RATE_WINDOW_MS 1000
+#define LOG_RATE_BURST 5         // warnings/errors per call site per window
+#define LOG_MAX_LIMITERS 256     // call sites whose suppressed counts the flusher can report
+
+typedef enum { LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR } LogLevel;
+
+typedef union {
+    long long i;
+    unsigned long long u;
+    double d;
+    const void *p;
+    unsigned short str; // offset into LogRecord.strs
+} LogArg;
+
+typedef struct {
+    unsigned long long seq; // global call order, for merging the rings
+    long long t_ns;         // CLOCK_REALTIME
+    const char *fmt;
+    unsigned char level;
+    unsigned char nargs;
+    unsigned short str_used;
+    LogArg args[LOG_MAX_ARGS];
+    char strs[LOG_STR_BYTES];
+} LogRecord;
+
+typedef struct {
+    LogRecord records[LOG_RING_RECORDS];
+    atomic_uint head;    // written by the owning thread
+    atomic_uint tail;    // written by the flusher
+    atomic_uint dropped;
+    char name[LOG_THREAD_NAME_SIZE];
+} LogRing;
+
+// Per call site budget for log_warn/log_error
+typedef struct {
+    _Atomic long long window;
+    atomic_int used;
+    atomic_int suppressed;
+    atomic_int registered;   // listed in log_limiters, so the flusher reports it
+    const char *fmt;         // set before registering, for the flusher's report
+    LogLevel level;
+} LogLimiter;
+
+static LogRing *_Atomic log_rings[LOG_MAX_THREADS];
+static atomic_int log_ring_count;
+static atomic_int log_min_level = LOG_LEVEL_INFO;
+static atomic_ullong log_seq;
+static atomic_uint log_unregistered_drops; // threads beyond LOG_MAX_THREADS
+static LogLimiter *_Atomic log_limiters[LOG_MAX_LIMITERS];
+static atomic_int log_limiter_count;
+static int log_json;
+static _Thread_local LogRing *log_my_ring;
+static _Thread_local char log_my_name[LOG_THREAD_NAME_SIZE];
+
+static const char *log_level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static inline long long log_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Names the calling thread's records; call before its first log line
+static inline void log_thread_name(const char *name) {
+    snprintf(log_my_name, sizeof(log_my_name), "%s", name);
+    if (log_my_ring) snprintf(log_my_ring->name, sizeof(log_my_ring->name), "%s", name);
+}
+
+static inline void log_set_level(LogLevel level) {
+    atomic_store(&log_min_level, level);
+}
+
+// "debug", "info", "warn" or "error"; returns 0 for anything else
+static inline int log_parse_level(const char *name, LogLevel *level) {
+    for (int l = LOG_LEVEL_DEBUG; l <= LOG_LEVEL_ERROR; l++) {
+        if (strcasecmp(name, log_level_names[l]) == 0) { *level = (LogLevel)l; return 1; }
+    }
+    return 0;
+}
+
+// Allocates the calling thread's ring, once per thread
+static inline LogRing *log_ring_for_thread(void) {
+    if (log_my_ring) return log_my_ring;
+    int slot = atomic_fetch_add(&log_ring_count, 1);
+    if (slot >= LOG_MAX_THREADS) {
+        atomic_store(&log_ring_count, LOG_MAX_THREADS);
+        return NULL;
+    }
+    LogRing *r = calloc(1, sizeof(LogRing));
+    if (!r) return NULL;
+    if (log_my_name[0]) snprintf(r->name, sizeof(r->name), "%s", log_my_name);
+    else snprintf(r->name, sizeof(r->name), "thread-%u", (unsigned)slot % LOG_MAX_THREADS);
+    atomic_store_explicit(&log_rings[slot], r, memory_order_release);
+    log_my_ring = r;
+    return r;
+}
+
+// Steps over one conversion spec after '%'; returns its conversion char and length modifier
+static inline const char *log_parse_spec(const char *f, char *conv, char *len) {
+    while (*f && strchr("-+ #0", *f)) f++;
+    while (*f >= '0' && *f <= '9') f++;
+    if (*f == '.') { f++; while (*f >= '0' && *f <= '9') f++; }
+    *len = 0;
+    if (*f == 'h') { f++; if (*f == 'h') f++; }
+    else if (*f == 'l') { *len = 'l'; f++; if (*f == 'l') { *len = 'q'; f++; } }
+    else if (*f == 'z' || *f == 'j' || *f == 't' || *f == 'L') *len = *f++;
+    *conv = *f;
+    return *f ? f + 1 : f;
+}
+
+// Producer side: copies the arguments out of the va_list, no formatting
+static inline void log_capture(LogRecord *r, const char *fmt, va_list ap) {
+    r->nargs = 0;
+    r->str_used = 0;
+    for (const char *f = fmt; *f;) {
+        if (*f++ != '%') continue;
+        if (*f == '%') { f++; continue; }
+        char conv, len;
+        f = log_parse_spec(f, &conv, &len);
+        if (!conv || r->nargs == LOG_MAX_ARGS) break;
+        LogArg *a = &r->args[r->nargs++];
+        switch (conv) {
+        case 'd': case 'i':
+            a->i = len == 'q' ? va_arg(ap, long long) : len == 'l' ? va_arg(ap, long)
+                 : len == 'z' || len == 't' ? (long long)va_arg(ap, ptrdiff_t) : len == 'j' ? (long long)va_arg(ap, intmax_t) : va_arg(ap, int);
+            break;
+        case 'u': case 'x': case 'X': case 'o': case 'c':
+            a->u = len == 'q' ? va_arg(ap, unsigned long long) : len == 'l' ? va_arg(ap, unsigned long)
+                 : len == 'z' || len == 't' ? (unsigned long long)va_arg(ap, size_t) : len == 'j' ? (unsigned long long)va_arg(ap, uintmax_t) : va_arg(ap, unsigned);
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            a->d = len == 'L' ? (double)va_arg(ap, long double) : va_arg(ap, double);
+            break;
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            if (!s) s = "(null)";
+            size_t room = LOG_STR_BYTES - r->str_used;
+            size_t n = strlen(s);
+            if (room == 0) { a->str = LOG_STR_BYTES - 1; break; } // points at the final NUL
+            if (n >= room) n = room - 1;                               // truncated
+            memcpy(r->strs + r->str_used, s, n);
+            r->strs[r->str_used + n] = '\0';
+            a->str = r->str_used;
+            r->str_used += n + 1;
+            break;
+        }
+        case 'p': a->p = va_arg(ap, void *); break;
+        default: r->nargs--; return; // unsupported, stop here; the flusher stops at the same spec
+        }
+    }
+}
+
+static inline void log_vwrite(LogLevel level, const char *fmt, va_list ap) {
+    LogRing *r = log_ring_for_thread();
+    if (!r) { atomic_fetch_add(&log_unregistered_drops, 1); return; }
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_RECORDS) { atomic_fetch_add(&r->dropped, 1); return; }
+    LogRecord *rec = &r->records[head & (LOG_RING_RECORDS - 1)];
+    rec->seq = atomic_fetch_add(&log_seq, 1);
+    rec->t_ns = log_now_ns();
+    rec->fmt = fmt;
+    rec->level = level;
+    log_capture(rec, fmt, ap);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+__attribute__((format(printf, 2, 3)))
+static inline void log_write(LogLevel level, const char *fmt, ...) {
+    if ((int)level < atomic_load_explicit(&log_min_level, memory_order_relaxed)) return;
+    va_list ap;
+    va_start(ap, fmt);
+    log_vwrite(level, fmt, ap);
+    va_end(ap);
+}
+
+__attribute__((format(printf, 3, 4)))
+static inline void log_limited(LogLimiter *l, LogLevel level, const char *fmt, ...) {
+    if ((int)level < atomic_load_explicit(&log_min_level, memory_order_relaxed)) return;
+    long long window = log_now_ns() / (LOG_RATE_WINDOW_MS * 1000000LL);
+    long long seen = atomic_load(&l->window);
+    if (seen != window && atomic_compare_exchange_strong(&l->window, &seen, window)) {
+        atomic_store(&l->used, 0);
+        int suppressed = atomic_exchange(&l->suppressed, 0);
+        if (suppressed > 0) log_write(level, "[log] %d line(s) like the next one suppressed", suppressed);
+    }
+    if (atomic_fetch_add(&l->used, 1) >= LOG_RATE_BURST) {
+        atomic_fetch_add(&l->suppressed, 1);
+        if (!atomic_exchange(&l->registered, 1)) { // first suppression at this site: let the flusher see it
+            l->fmt = fmt;
+            l->level = level;
+            int slot = atomic_fetch_add(&log_limiter_count, 1);
+            if (slot < LOG_MAX_LIMITERS) atomic_store_explicit(&log_limiters[slot], l, memory_order_release);
+        }
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    log_vwrite(level, fmt, ap);
+    va_end(ap);
+}
+
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) do { static LogLimiter log_site_; log_limited(&log_site_, LOG_LEVEL_WARN, __VA_ARGS__); } while (0)
+#define log_error(...) do { static LogLimiter log_site_; log_limited(&log_site_, LOG_LEVEL_ERROR, __VA_ARGS__); } while (0)
+
+// Flusher side: formats a record the way printf would have
+static inline void log_format(const LogRecord *r, char *out, size_t size) {
+    size_t used = 0;
+    int arg = 0;
+    for (const char *f = r->fmt; *f && used + 1 < size;) {
+        if (*f != '%') { out[used++] = *f++; continue; }
+        if (f[1] == '%') { out[used++] = '%'; f += 2; continue; }
+        const char *start = f;
+        char conv, len;
+        f = log_parse_spec(f + 1, &conv, &len);
+        if (!conv || arg >= r->nargs) break;
+
+        // Rebuild the spec with the length the stored argument actually has
+        char spec[32];
+        size_t body = 0;
+        for (const char *c = start; c < f - 1 && body < sizeof(spec) - 4; c++) {
+            if (!strchr("hlzjtL", *c)) spec[body++] = *c;
+        }
+        const LogArg *a = &r->args[arg++];
+        int n;
+        switch (conv) {
+        case 'd': case 'i': spec[body++] = 'l'; spec[body++] = 'l'; spec[body++] = conv; spec[body] = '\0';
+            n = snprintf(out + used, size - used, spec, a->i); break;
+        case 'u': case 'x': case 'X': case 'o': spec[body++] = 'l'; spec[body++] = 'l'; spec[body++] = conv; spec[body] = '\0';
+            n = snprintf(out + used, size - used, spec, a->u); break;
+        case 'c': spec[body++] = conv; spec[body] = '\0';
+            n = snprintf(out + used, size - used, spec, (int)a->u); break;
+        case 's': spec[body++] = conv; spec[body] = '\0';
+            n = snprintf(out + used, size - used, spec, r->strs + a->str); break;
+        case 'p': spec[body++] = conv; spec[body] = '\0';
+            n = snprintf(out + used, size - used, spec, a->p); break;
+        default: spec[body++] = conv; spec[body] = '\0';
+            n = snprintf(out + used, size - used, spec, a->d); break;
+        }
+        if (n < 0) break;
+        used += (size_t)n < size - used ? (size_t)n : size - used - 1;
+    }
+    while (used > 0 && out[used - 1] == '\n') used--; // the flusher ends every line itself
+    out[used] = '\0';
+}
+
+static inline void log_emit(FILE *out, const LogRecord *r, const char *thread) {
+    char msg[LOG_LINE_SIZE];
+    log_format(r, msg, sizeof(msg));
+    time_t secs = r->t_ns / 1000000000LL;
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    char ts[32];
+    size_t tl = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(ts + tl, sizeof(ts) - tl, ".%03lldZ", (r->t_ns / 1000000LL) % 1000);
+
+    if (!log_json) {
+        fprintf(out, "%s %-5s %s: %s\n", ts, log_level_names[r->level], thread, msg);
+        return;
+    }
+    fprintf(out, "{\"ts\":\"%s\",\"level\":\"%s\",\"thread\":\"%s\",\"msg\":\"", ts, log_level_names[r->level], thread);
+    for (const char *c = msg; *c; c++) {
+        if (*c == '"' || *c == '\\') fprintf(out, "\\%c", *c);
+        else if ((unsigned char)*c < 0x20) fprintf(out, "\\u%04x", (unsigned char)*c);
+        else fputc(*c, out);
+    }
+    fputs("\"}\n", out);
+}
+
+// Drains every ring in call order. Returns the number of records written.
+static inline int log_drain(void) {
+    static unsigned reported[LOG_MAX_THREADS];
+    static unsigned reported_unregistered;
+    int written = 0, rings = atomic_load(&log_ring_count);
+    FILE *last = NULL;
+    if (rings > LOG_MAX_THREADS) rings = LOG_MAX_THREADS;
+    while (1) {
+        LogRing *best = NULL;
+        const LogRecord *best_rec = NULL;
+        for (int i = 0; i < rings; i++) {
+            LogRing *r = atomic_load_explicit(&log_rings[i], memory_order_acquire);
+            if (!r) continue;
+            unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            if (tail == atomic_load_explicit(&r->head, memory_order_acquire)) continue;
+            const LogRecord *rec = &r->records[tail & (LOG_RING_RECORDS - 1)];
+            if (!best_rec || rec->seq < best_rec->seq) { best = r; best_rec = rec; }
+        }
+        if (!best) break;
+        FILE *out = best_rec->level >= LOG_LEVEL_WARN ? stderr : stdout;
+        if (last && out != last) fflush(last); // keeps call order when both go to one terminal
+        last = out;
+        log_emit(out, best_rec, best->name);
+        atomic_store_explicit(&best->tail, atomic_load_explicit(&best->tail, memory_order_relaxed) + 1, memory_order_release);
+        written++;
+    }
+    for (int i = 0; i < rings; i++) {
+        LogRing *r = atomic_load_explicit(&log_rings[i], memory_order_acquire);
+        if (!r) continue;
+        unsigned dropped = atomic_load(&r->dropped);
+        if (dropped != reported[i]) {
+            fprintf(stderr, "[log] %s: %u line(s) dropped, ring full\n", r->name, dropped - reported[i]);
+            reported[i] = dropped;
+        }
+    }
+    unsigned lost = atomic_load(&log_unregistered_drops);
+    if (lost != reported_unregistered) {
+        fprintf(stderr, "[log] %u line(s) dropped from threads beyond %d\n", lost - reported_unregistered, LOG_MAX_THREADS);
+        reported_unregistered = lost;
+    }
+    if (written) { fflush(stdout); fflush(stderr); }
+    return written;
+}
+
+// Reports what quiet call sites suppressed in a window that has ended. The call site's own
+// report and this one both take the count with an exchange, so it is never reported twice.
+static inline void log_report_suppressed(void) {
+    long long window = log_now_ns() / (LOG_RATE_WINDOW_MS * 1000000LL);
+    int sites = atomic_load(&log_limiter_count);
+    if (sites > LOG_MAX_LIMITERS) sites = LOG_MAX_LIMITERS;
+    for (int i = 0; i < sites; i++) {
+        LogLimiter *l = atomic_load_explicit(&log_limiters[i], memory_order_acquire);
+        if (!l || atomic_load(&l->window) == window) continue; // still in its window, the site reports it
+        int suppressed = atomic_exchange(&l->suppressed, 0);
+        if (suppressed <= 0) continue;
+        LogRecord rec = { .t_ns = log_now_ns(), .fmt = "[log] %d line(s) suppressed like: %s", .level = l->level, .nargs = 2 };
+        rec.args[0].i = suppressed;
+        rec.args[1].str = 0;
+        snprintf(rec.strs, sizeof(rec.strs), "%s", l->fmt);
+        rec.strs[strcspn(rec.strs, "\n")] = '\0';
+        log_emit(l->level >= LOG_LEVEL_WARN ? stderr : stdout, &rec, "log");
+        fflush(l->level >= LOG_LEVEL_WARN ? stderr : stdout);
+    }
+}
+
+static inline void *log_flusher_thread(void *arg) {
+    (void)arg;
+    long long next_report_ns = log_now_ns() + LOG_RATE_WINDOW_MS * 1000000LL;
+    while (1) {
+        log_drain();
+        if (log_now_ns() >= next_report_ns) {
+            log_report_suppressed();
+            next_report_ns += LOG_RATE_WINDOW_MS * 1000000LL;
+        }
+        struct timespec req = { 0, LOG_FLUSH_MS * 1000000L };
+        nanosleep(&req, NULL);
+    }
+    return NULL;
+}
+
+// Starts the background flusher; json selects JSON lines instead of text
+static inline int log_start(int json) {
+    log_json = json;
+    pthread_t t;
+    if (pthread_create(&t, NULL, log_flusher_thread, NULL) != 0) return 0;
+    pthread_detach(t);
+    return 1;
+}
+
+#endif
@@ -1,11 +1,17 @@
 /* client_mysql.c
-   MySQL-based client: optionally send TCP command, and poll DB every 250 ms.
+   MySQL-based client: optionally send TCP command, then monitor peer commands pushed by the controller
+   (falls back to polling the DB every 250 ms if the controller stream is unavailable).
    Compile:
      gcc client_mysql.c -o client_mysql -lmysqlclient -lm
    Usage:
-     ./client_mysql <client_id> [send_percent]
+     ./client_mysql <client_id> [send_percent [low|normal|high|critical [ttl_ms]]]
+     ./client_mysql <client_id> --history <field> <range_s> <resolution_s>
+     ./client_mysql <client_id> --export <from_epoch_s> <to_epoch_s> <prefix>
+     ./client_mysql <client_id> --archive <from_epoch_s> <to_epoch_s> <file> [fraction_bits]
+   Any of these take a trailing --shard N to pick the motor.
 */
 
+#define _GNU_SOURCE //SO_PEERCRED in local_socket.h
 #define _POSIX_C_SOURCE 200809L 
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,7 +24,10 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <errno.h>
+#include "local_socket.h"
+#include "telemetry_archive.h" //columnar archive format shared with telemetry_archive
 #include <arpa/inet.h>
 
 const char *db_host = "127.0.0.1";
@@ -29,7 +38,11 @@ unsigned int db_port = 3306;
 
 #define TCP_PORT 9090
 #define TCP_HOST "127.0.0.1"
+#define ROLLUP_TIERS 3
 #define POLL_MS 250 //clients read from the database every 250ms as required by spec
+#define ARCHIVE_PAGE_ROWS 8192 //telemetry rows per query while archiving
+
+int shard_id = 0; //which motor to talk to, each shard's controller listens on TCP_PORT + shard_id
 
 long long now_ms() {
     struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
@@ -41,36 +54,293 @@ void msleep(long ms) {
     nanosleep(&req, NULL); //more precise sleep function (points to the req timespec for handling)
 }
 
-void send_tcp_command(const char *client_id, double percent) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+// Connects to the shard's controller: its Unix socket when one is running on this host, which
+// skips the TCP stack and identifies us by uid, otherwise TCP. The Unix socket is only used if
+// the directory it lives in is private and the process answering runs as that directory's owner. The protocol is the same text
+// either way. Returns the socket or -1.
+int connect_controller(const char **via) {
+    int sock = local_socket_connect(shard_id);
+    if (sock >= 0) {
+        *via = "unix";
+        return sock;
+    } //no local controller, fall back to TCP
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("socket");
-        return;
+        return -1;
     }
     struct sockaddr_in srv;
     srv.sin_family = AF_INET;
-    srv.sin_port = htons(TCP_PORT);
+    srv.sin_port = htons(TCP_PORT + shard_id);
     inet_pton(AF_INET, TCP_HOST, &srv.sin_addr);
     if (connect(sock, (struct sockaddr*)&srv, sizeof(srv)) < 0) {
         perror("connect");
         close(sock);
-        return;
+        return -1;
     }
+    *via = "tcp";
+    return sock;
+}
+
+void send_tcp_command(const char *client_id, double percent, const char *priority, const char *ttl_ms) {
+    const char *via;
+    int sock = connect_controller(&via);
+    if (sock < 0) return;
     char buf[256];
-    snprintf(buf, sizeof(buf), "%s %.6f", client_id, percent);
+    snprintf(buf, sizeof(buf), "%s %.6f %s %s", client_id, percent, priority ? priority : "normal", ttl_ms ? ttl_ms : "0");
     write(sock, buf, strlen(buf));
     char rbuf[64];
     ssize_t r = read(sock, rbuf, sizeof(rbuf)-1);
-    if (r>0) { rbuf[r]=0; printf("[tcp] reply: %s", rbuf); }
+    if (r>0) { rbuf[r]=0; printf("[%s] reply: %s", via, rbuf); }
     close(sock);
 }
 
+// Subscribes to the controller's command fan-out. Returns the open socket or -1.
+int subscribe_tcp_commands(const char *client_id) {
+    const char *via;
+    int sock = connect_controller(&via);
+    if (sock < 0) return -1;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "SUBSCRIBE %s\n", client_id);
+    write(sock, buf, strlen(buf));
+    return sock;
+}
+
+// Prints commands pushed by the controller until it closes the stream.
+// last_id tracks the newest command seen so a DB fallback resumes without duplicates.
+void stream_commands(int sock, long long *last_id) {
+    char buf[4096];
+    size_t used = 0;
+    while (1) {
+        ssize_t r = read(sock, buf + used, sizeof(buf) - 1 - used);
+        if (r <= 0) break;
+        used += r;
+        buf[used] = 0;
+
+        char *line = buf;
+        char *nl;
+        while ((nl = strchr(line, '\n'))) {
+            *nl = 0;
+            long long id;
+            if (sscanf(line, "id=%lld", &id) == 1) {
+                if (id > *last_id) {
+                    printf("[cmd] %s\n", line);
+                    *last_id = id;
+                }
+            } else {
+                printf("[tcp] %s\n", line);
+            }
+            line = nl + 1;
+        }
+        used = strlen(line);
+        if (used == sizeof(buf) - 1) used = 0; // drop an overlong partial line
+        memmove(buf, line, used);
+    }
+    close(sock);
+}
+
+const char *telemetry_fields[] = { "gas_level", "battery_level", "motor_speed", "motor_speed_set_point", "motor_temp" };
+
+// Rollup tables maintained by the controller, finest first
+const struct { const char *table; long long period_s; } rollup_tiers[ROLLUP_TIERS] = {
+    { "telemetry_rollup_1s", 1 },
+    { "telemetry_rollup_1m", 60 },
+    { "telemetry_rollup_1h", 3600 },
+};
+
+// Picks the coarsest rollup tier whose bucket fits both the requested resolution and the range.
+// Returns NULL when only raw telemetry is fine enough.
+const char *pick_rollup_table(long long range_s, long long resolution_s) {
+    for (int t = ROLLUP_TIERS - 1; t >= 0; t--) {
+        if (rollup_tiers[t].period_s <= resolution_s && rollup_tiers[t].period_s <= range_s) {
+            return rollup_tiers[t].table;
+        }
+    }
+    return NULL;
+}
+
+// Builds the history query for one field: bucket time, min, max, avg, last.
+// Returns 0 if the field is not a telemetry column.
+int build_history_query(char *q, size_t q_size, const char *field, long long range_s, long long resolution_s) {
+    int known = 0;
+    for (size_t i = 0; i < sizeof(telemetry_fields) / sizeof(telemetry_fields[0]); i++) {
+        if (strcmp(field, telemetry_fields[i]) == 0) known = 1;
+    }
+    if (!known) return 0; // field is pasted into SQL, only whitelisted names get through
+
+    const char *table = pick_rollup_table(range_s, resolution_s);
+    if (table) {
+        snprintf(q, q_size,
+            "SELECT bucket_ts, %s_min, %s_max, %s_avg, %s_last FROM %s "
+            "WHERE shard_id = %d AND bucket_ts >= NOW() - INTERVAL %lld SECOND ORDER BY bucket_ts ASC",
+            field, field, field, field, table, shard_id, range_s);
+    } else {
+        snprintf(q, q_size,
+            "SELECT ts, %s, %s, %s, %s FROM telemetry "
+            "WHERE shard_id = %d AND ts >= NOW() - INTERVAL %lld SECOND ORDER BY ts ASC",
+            field, field, field, field, shard_id, range_s);
+    }
+    return 1;
+}
+
+// Prints telemetry history for one field from the coarsest table that satisfies the request
+int print_history(MYSQL *conn, const char *field, long long range_s, long long resolution_s) {
+    char q[512];
+    if (!build_history_query(q, sizeof(q), field, range_s, resolution_s)) {
+        fprintf(stderr, "unknown telemetry field: %s\n", field);
+        return 1;
+    }
+    const char *table = pick_rollup_table(range_s, resolution_s);
+    printf("[history] %s over %llds from %s\n", field, range_s, table ? table : "telemetry");
+    if (mysql_query(conn, q)) {
+        fprintf(stderr, "history select failed: %s\n", mysql_error(conn));
+        return 1;
+    }
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) return 1;
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res))) {
+        printf("%s min=%s max=%s avg=%s last=%s\n", row[0], row[1], row[2], row[3], row[4]);
+    }
+    mysql_free_result(res);
+    return 0;
+}
+
+// Writes the commands and telemetry between two epoch seconds as <prefix>.commands and
+// <prefix>.telemetry for command_replay. Times are ms offsets from the start of the range; the
+// telemetry row just before the range is included (negative offset) as the replay's initial state.
+// MySQL TIMESTAMP columns only keep whole seconds, so offsets are second-aligned.
+int export_range(MYSQL *conn, long long from_s, long long to_s, const char *prefix) {
+    char path[512], q[1024];
+    long long from_ms = from_s * 1000LL;
+
+    snprintf(path, sizeof(path), "%s.commands", prefix);
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return 1; }
+    snprintf(q, sizeof(q),
+             "SELECT CAST(UNIX_TIMESTAMP(ts) AS SIGNED) * 1000 - %lld, percent_change, client_id, COALESCE(priority, 1), expires_ms - %lld "
+             "FROM commands WHERE shard_id = %d AND ts >= FROM_UNIXTIME(%lld) AND ts < FROM_UNIXTIME(%lld) "
+             "ORDER BY ts ASC, id ASC",
+             from_ms, from_ms, shard_id, from_s, to_s);
+    if (mysql_query(conn, q)) {
+        fprintf(stderr, "export select failed: %s\n", mysql_error(conn));
+        fclose(f);
+        return 1;
+    }
+    MYSQL_RES *res = mysql_store_result(conn);
+    int commands = 0;
+    fprintf(f, "# ms_offset percent_change client_id priority expires_ms_offset\n"); //expired commands are kept, command_replay decides again
+    if (res) {
+        MYSQL_ROW row;
+        while ((row = mysql_fetch_row(res))) {
+            fprintf(f, "%s %s %s %s %s\n", row[0], row[1], row[2] ? row[2] : "tcp_client", row[3], row[4] ? row[4] : "none");
+            commands++;
+        }
+        mysql_free_result(res);
+    }
+    fclose(f);
+
+    snprintf(path, sizeof(path), "%s.telemetry", prefix);
+    f = fopen(path, "w");
+    if (!f) { perror(path); return 1; }
+    snprintf(q, sizeof(q),
+             "SELECT CAST(UNIX_TIMESTAMP(ts) AS SIGNED) * 1000 - %lld, gas_level, battery_level, motor_speed, motor_speed_set_point, motor_temp "
+             "FROM telemetry WHERE shard_id = %d "
+             "AND ts >= (SELECT COALESCE(MAX(t.ts), FROM_UNIXTIME(%lld)) FROM telemetry t WHERE t.shard_id = %d AND t.ts < FROM_UNIXTIME(%lld)) "
+             "AND ts < FROM_UNIXTIME(%lld) ORDER BY ts ASC, id ASC",
+             from_ms, shard_id, from_s, shard_id, from_s, to_s);
+    if (mysql_query(conn, q)) {
+        fprintf(stderr, "export select failed: %s\n", mysql_error(conn));
+        fclose(f);
+        return 1;
+    }
+    res = mysql_store_result(conn);
+    int rows = 0;
+    fprintf(f, "# ms_offset gas_level battery_level motor_speed motor_speed_set_point motor_temp\n");
+    if (res) {
+        MYSQL_ROW row;
+        while ((row = mysql_fetch_row(res))) {
+            fprintf(f, "%s %s %s %s %s %s\n", row[0], row[1], row[2], row[3], row[4], row[5]);
+            rows++;
+        }
+        mysql_free_result(res);
+    }
+    fclose(f);
+
+    printf("[export] %d commands and %d telemetry rows written to %s.commands / %s.telemetry\n", commands, rows, prefix, prefix);
+    return 0;
+}
+
+// Writes the telemetry between two epoch seconds to a compressed columnar archive for
+// telemetry_archive, so analysis can run offline. Rows are fetched a page at a time.
+int archive_range(MYSQL *conn, long long from_s, long long to_s, const char *path, int fraction_bits) {
+    ArchiveWriter w;
+    if (!archive_writer_open(&w, path, fraction_bits)) return 1;
+
+    long long last_id = 0;
+    int ok = 1;
+    while (ok) {
+        char q[512];
+        snprintf(q, sizeof(q), //keyset paging on id so each page is an index range scan
+                 "SELECT id, CAST(UNIX_TIMESTAMP(ts) AS SIGNED) * 1000, gas_level, battery_level, motor_speed, "
+                 "motor_speed_set_point, motor_temp FROM telemetry WHERE shard_id = %d AND id > %lld "
+                 "AND ts >= FROM_UNIXTIME(%lld) AND ts < FROM_UNIXTIME(%lld) ORDER BY id ASC LIMIT %d",
+                 shard_id, last_id, from_s, to_s, ARCHIVE_PAGE_ROWS);
+        if (mysql_query(conn, q)) {
+            fprintf(stderr, "archive select failed: %s\n", mysql_error(conn));
+            ok = 0;
+            break;
+        }
+        MYSQL_RES *res = mysql_store_result(conn);
+        if (!res) { ok = 0; break; }
+        int rows = 0;
+        MYSQL_ROW row;
+        while (ok && (row = mysql_fetch_row(res))) {
+            double v[ARCHIVE_FIELDS];
+            for (int f = 0; f < ARCHIVE_FIELDS; f++) v[f] = row[2 + f] ? strtod(row[2 + f], NULL) : 0.0; //mysql sends full precision text
+            last_id = atoll(row[0]);
+            rows++;
+            if (!row[1]) continue; //the range filter already drops a NULL ts
+            ok = archive_writer_append(&w, atoll(row[1]), v);
+        }
+        mysql_free_result(res);
+        if (rows < ARCHIVE_PAGE_ROWS) break;
+    }
+
+    long long rows = w.rows;
+    int blocks = w.blocks + (w.cur.rows > 0);
+    if (!archive_writer_close(&w)) ok = 0;
+    if (!ok) { fprintf(stderr, "archive %s failed\n", path); return 1; }
+    printf("[archive] %lld telemetry rows in %d blocks written to %s\n", rows, blocks, path);
+    return 0;
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2) { fprintf(stderr, "usage: %s <client_id> [send_percent]\n", argv[0]); return 1; }
+    if (argc >= 4 && strcmp(argv[argc - 2], "--shard") == 0) { //optional trailing "--shard N" picks the motor
+        shard_id = atoi(argv[argc - 1]);
+        if (shard_id < 0) shard_id = 0;
+        argc -= 2; //everything before it stays positional
+    }
+    if (argc < 2) { fprintf(stderr, "usage: %s <client_id> [send_percent [low|normal|high|critical [ttl_ms]]] [--shard N]\n", argv[0]); return 1; }
     const char *client_id = argv[1];
     double send_percent = 0;
     int will_send = 0;
-    if (argc >= 3) { will_send = 1; send_percent = atof(argv[2]); }
+    if (argc >= 3 && strcmp(argv[2], "--history") == 0 && argc < 6) {
+        fprintf(stderr, "usage: %s <client_id> --history <field> <range_s> <resolution_s>\n", argv[0]);
+        return 1;
+    }
+    if (argc >= 3 && strcmp(argv[2], "--export") == 0 && argc < 6) {
+        fprintf(stderr, "usage: %s <client_id> --export <from_epoch_s> <to_epoch_s> <prefix>\n", argv[0]);
+        return 1;
+    }
+    if (argc >= 3 && strcmp(argv[2], "--archive") == 0 && argc < 6) {
+        fprintf(stderr, "usage: %s <client_id> --archive <from_epoch_s> <to_epoch_s> <file> [fraction_bits]\n", argv[0]);
+        return 1;
+    }
+    if (argc >= 3 && strncmp(argv[2], "--", 2) != 0) { will_send = 1; send_percent = atof(argv[2]); }
+    const char *send_priority = will_send && argc >= 4 ? argv[3] : NULL;
+    const char *send_ttl_ms = will_send && argc >= 5 ? argv[4] : NULL;
 
     MYSQL *conn = mysql_init(NULL);
     if (!conn) { fprintf(stderr, "mysql_init failed\n"); return 1; }
@@ -79,12 +349,34 @@ int main(int argc, char **argv) {
         mysql_close(conn); return 1;
     }
 
+    if (argc >= 6 && strcmp(argv[2], "--history") == 0) { //dashboard style query instead of monitoring
+        int rc = print_history(conn, argv[3], atoll(argv[4]), atoll(argv[5]));
+        mysql_close(conn);
+        return rc;
+    }
+    if (argc >= 6 && strcmp(argv[2], "--export") == 0) { //dump a range for command_replay
+        int rc = export_range(conn, atoll(argv[3]), atoll(argv[4]), argv[5]);
+        mysql_close(conn);
+        return rc;
+    }
+    if (argc >= 6 && strcmp(argv[2], "--archive") == 0) { //compressed columnar archive for offline analysis
+        int rc = archive_range(conn, atoll(argv[3]), atoll(argv[4]), argv[5], argc >= 7 ? atoi(argv[6]) : -1);
+        mysql_close(conn);
+        return rc;
+    }
+
     if (will_send) {
-        printf("[client] sending %+.3f via TCP to controller\n", send_percent);
-        send_tcp_command(client_id, send_percent);
+        printf("[client] sending %+.3f to controller\n", send_percent);
+        send_tcp_command(client_id, send_percent, send_priority, send_ttl_ms);
     }
 
     long long last_id = 0;
+    int sock = subscribe_tcp_commands(client_id); //controller pushes peer commands so we don't hit the DB
+    if (sock >= 0) {
+        stream_commands(sock, &last_id);
+        printf("[client] controller stream closed, falling back to DB polling\n");
+    }
+
     while (1) {
         char q[256];
         snprintf(q, sizeof(q), "SELECT id, client_id, percent_change, ts FROM commands WHERE id > %lld ORDER BY id ASC", last_id);
@@ -1,11 +1,17 @@
 /* client_pgsql.c
-   PostgreSQL-based client: optionally send TCP command, and poll DB every 250 ms.
+   PostgreSQL-based client: optionally send TCP command, then monitor peer commands pushed by the controller
+   (falls back to polling the DB every 250 ms if the controller stream is unavailable).
    Compile:
      gcc -I/usr/local/opt/libpq/include client_pgsql.c -o client_pgsql -L/usr/local/opt/libpq/lib -lpq -lm
    Usage:
-     ./client_pgsql <client_id> [send_percent]
+     ./client_pgsql <client_id> [send_percent [low|normal|high|critical [ttl_ms]]]
+     ./client_pgsql <client_id> --history <field> <range_s> <resolution_s>
+     ./client_pgsql <client_id> --export <from_epoch_s> <to_epoch_s> <prefix>
+     ./client_pgsql <client_id> --archive <from_epoch_s> <to_epoch_s> <file> [fraction_bits]
+   Any of these take a trailing --shard N to pick the motor.
 */
 
+#define _GNU_SOURCE // SO_PEERCRED in local_socket.h
 #define _POSIX_C_SOURCE 200809L 
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,7 +24,11 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <errno.h>
+#include "local_socket.h"
+#include <stdint.h>
+#include "telemetry_archive.h"
 #include <arpa/inet.h>
 
 // PostgreSQL connection string 
@@ -26,7 +36,11 @@ const char *db_conninfo = "host=127.0.0.1 port=5432 dbname=motordb user=motoruse
 
 #define TCP_PORT 9090
 #define TCP_HOST "127.0.0.1"
+#define ROLLUP_TIERS 3
 #define POLL_MS 250
+#define ARCHIVE_PAGE_ROWS 8192
+
+int shard_id = 0; // which motor to talk to; each shard's controller listens on TCP_PORT + shard_id
 
 long long now_ms() {
     struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
@@ -38,41 +52,309 @@ void msleep(long ms) {
     nanosleep(&req, NULL);
 }
 
-// TCP send function stays the same as it connects to the same TCP server.
-void send_tcp_command(const char *client_id, double percent) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+// Connects to the shard's controller: its Unix socket when one is running on this host, which
+// skips the TCP stack and identifies us by uid, otherwise TCP. The Unix socket is only used if
+// the directory it lives in is private and the process answering runs as that directory's owner. The protocol is the same text
+// either way. Returns the socket or -1.
+int connect_controller(const char **via) {
+    int sock = local_socket_connect(shard_id);
+    if (sock >= 0) {
+        *via = "unix";
+        return sock;
+    } // no local controller, fall back to TCP
 
+    sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("socket");
-        return;
+        return -1;
     }
-
-    struct sockaddr_in srv; //socket decleration
-    srv.sin_family = AF_INET; //IPV4
-    srv.sin_port = htons(TCP_PORT); //sets port # to 9090
-    inet_pton(AF_INET, TCP_HOST, &srv.sin_addr); // converts the human-readable IP address string into a network address structure.
-
+    struct sockaddr_in srv;
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons(TCP_PORT + shard_id);
+    inet_pton(AF_INET, TCP_HOST, &srv.sin_addr);
     if (connect(sock, (struct sockaddr*)&srv, sizeof(srv)) < 0) {
         perror("connect");
         close(sock);
-        return;
+        return -1;
     }
+    *via = "tcp";
+    return sock;
+}
 
+// Sends one command and prints the controller's reply
+void send_tcp_command(const char *client_id, double percent, const char *priority, const char *ttl_ms) {
+    const char *via;
+    int sock = connect_controller(&via);
+    if (sock < 0) return;
     char buf[256];
-    snprintf(buf, sizeof(buf), "%s %.6f", client_id, percent);
+    snprintf(buf, sizeof(buf), "%s %.6f %s %s", client_id, percent, priority ? priority : "normal", ttl_ms ? ttl_ms : "0");
     write(sock, buf, strlen(buf));
     char rbuf[64];
     ssize_t r = read(sock, rbuf, sizeof(rbuf)-1);
-    if (r>0) { rbuf[r]=0; printf("[tcp] reply: %s", rbuf); }
+    if (r>0) { rbuf[r]=0; printf("[%s] reply: %s", via, rbuf); }
+    close(sock);
+}
+
+// Subscribes to the controller's command fan-out. Returns the open socket or -1.
+int subscribe_tcp_commands(const char *client_id) {
+    const char *via;
+    int sock = connect_controller(&via);
+    if (sock < 0) return -1;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "SUBSCRIBE %s\n", client_id);
+    write(sock, buf, strlen(buf));
+    return sock;
+}
+
+// Prints commands pushed by the controller until it closes the stream.
+// last_id tracks the newest command seen so a DB fallback resumes without duplicates.
+void stream_commands(int sock, long long *last_id) {
+    char buf[4096];
+    size_t used = 0;
+    while (1) {
+        ssize_t r = read(sock, buf + used, sizeof(buf) - 1 - used);
+        if (r <= 0) break;
+        used += r;
+        buf[used] = 0;
+
+        char *line = buf;
+        char *nl;
+        while ((nl = strchr(line, '\n'))) {
+            *nl = 0;
+            long long id;
+            if (sscanf(line, "id=%lld", &id) == 1) {
+                if (id > *last_id) {
+                    printf("[cmd] %s\n", line);
+                    *last_id = id;
+                }
+            } else {
+                printf("[tcp] %s\n", line);
+            }
+            line = nl + 1;
+        }
+        used = strlen(line);
+        if (used == sizeof(buf) - 1) used = 0; // drop an overlong partial line
+        memmove(buf, line, used);
+    }
     close(sock);
 }
 
+const char *telemetry_fields[] = { "gas_level", "battery_level", "motor_speed", "motor_speed_set_point", "motor_temp" };
+
+// Rollup tables maintained by the controller, finest first
+const struct { const char *table; long long period_s; } rollup_tiers[ROLLUP_TIERS] = {
+    { "telemetry_rollup_1s", 1 },
+    { "telemetry_rollup_1m", 60 },
+    { "telemetry_rollup_1h", 3600 },
+};
+
+// Picks the coarsest rollup tier whose bucket fits both the requested resolution and the range.
+// Returns NULL when only raw telemetry is fine enough.
+const char *pick_rollup_table(long long range_s, long long resolution_s) {
+    for (int t = ROLLUP_TIERS - 1; t >= 0; t--) {
+        if (rollup_tiers[t].period_s <= resolution_s && rollup_tiers[t].period_s <= range_s) {
+            return rollup_tiers[t].table;
+        }
+    }
+    return NULL;
+}
+
+// Builds the history query for one field: bucket time, min, max, avg, last.
+// Returns 0 if the field is not a telemetry column.
+int build_history_query(char *q, size_t q_size, const char *field, long long range_s, long long resolution_s) {
+    int known = 0;
+    for (size_t i = 0; i < sizeof(telemetry_fields) / sizeof(telemetry_fields[0]); i++) {
+        if (strcmp(field, telemetry_fields[i]) == 0) known = 1;
+    }
+    if (!known) return 0; // field is pasted into SQL, only whitelisted names get through
+
+    const char *table = pick_rollup_table(range_s, resolution_s);
+    if (table) {
+        snprintf(q, q_size,
+            "SELECT bucket_ts, %s_min, %s_max, %s_avg, %s_last FROM %s "
+            "WHERE shard_id = %d AND bucket_ts >= now() - interval '%lld seconds' ORDER BY bucket_ts ASC",
+            field, field, field, field, table, shard_id, range_s);
+    } else {
+        snprintf(q, q_size,
+            "SELECT ts, %s, %s, %s, %s FROM telemetry "
+            "WHERE shard_id = %d AND ts >= now() - interval '%lld seconds' ORDER BY ts ASC",
+            field, field, field, field, shard_id, range_s);
+    }
+    return 1;
+}
+
+// Prints telemetry history for one field from the coarsest table that satisfies the request
+int print_history(PGconn *conn, const char *field, long long range_s, long long resolution_s) {
+    char q[512];
+    if (!build_history_query(q, sizeof(q), field, range_s, resolution_s)) {
+        fprintf(stderr, "unknown telemetry field: %s\n", field);
+        return 1;
+    }
+    const char *table = pick_rollup_table(range_s, resolution_s);
+    printf("[history] %s over %llds from %s\n", field, range_s, table ? table : "telemetry");
+
+    PGresult *res = PQexec(conn, q);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "history select failed: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        return 1;
+    }
+    int rows = PQntuples(res);
+    for (int i = 0; i < rows; i++) {
+        printf("%s min=%s max=%s avg=%s last=%s\n", PQgetvalue(res, i, 0), PQgetvalue(res, i, 1),
+            PQgetvalue(res, i, 2), PQgetvalue(res, i, 3), PQgetvalue(res, i, 4));
+    }
+    PQclear(res);
+    return 0;
+}
+
+// Writes the commands and telemetry between two epoch seconds as <prefix>.commands and
+// <prefix>.telemetry for command_replay. Times are ms offsets from the start of the range; the
+// telemetry row just before the range is included (negative offset) as the replay's initial state.
+int export_range(PGconn *conn, long long from_s, long long to_s, const char *prefix) {
+    char path[512], q[1024];
+    long long from_ms = from_s * 1000LL;
+
+    snprintf(path, sizeof(path), "%s.commands", prefix);
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return 1; }
+    snprintf(q, sizeof(q),
+        "SELECT (EXTRACT(EPOCH FROM ts) * 1000)::bigint - %lld, percent_change, client_id, COALESCE(priority, 1), expires_ms - %lld "
+        "FROM commands WHERE shard_id = %d AND ts >= to_timestamp(%lld) AND ts < to_timestamp(%lld) "
+        "ORDER BY ts ASC, id ASC",
+        from_ms, from_ms, shard_id, from_s, to_s);
+    PGresult *res = PQexec(conn, q);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "export select failed: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        fclose(f);
+        return 1;
+    }
+    int commands = PQntuples(res);
+    // Expired commands are kept: command_replay decides again whether they expire
+    fprintf(f, "# ms_offset percent_change client_id priority expires_ms_offset\n");
+    for (int i = 0; i < commands; i++) {
+        const char *cid = PQgetisnull(res, i, 2) ? "tcp_client" : PQgetvalue(res, i, 2);
+        const char *expires = PQgetisnull(res, i, 4) ? "none" : PQgetvalue(res, i, 4);
+        fprintf(f, "%s %s %s %s %s\n", PQgetvalue(res, i, 0), PQgetvalue(res, i, 1), cid, PQgetvalue(res, i, 3), expires);
+    }
+    PQclear(res);
+    fclose(f);
+
+    snprintf(path, sizeof(path), "%s.telemetry", prefix);
+    f = fopen(path, "w");
+    if (!f) { perror(path); return 1; }
+    snprintf(q, sizeof(q),
+        "SELECT (EXTRACT(EPOCH FROM ts) * 1000)::bigint - %lld, gas_level, battery_level, motor_speed, motor_speed_set_point, motor_temp "
+        "FROM telemetry WHERE shard_id = %d "
+        "AND ts >= (SELECT COALESCE(MAX(ts), to_timestamp(%lld)) FROM telemetry WHERE shard_id = %d AND ts < to_timestamp(%lld)) "
+        "AND ts < to_timestamp(%lld) ORDER BY ts ASC, id ASC",
+        from_ms, shard_id, from_s, shard_id, from_s, to_s);
+    res = PQexec(conn, q);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "export select failed: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        fclose(f);
+        return 1;
+    }
+    int rows = PQntuples(res);
+    fprintf(f, "# ms_offset gas_level battery_level motor_speed motor_speed_set_point motor_temp\n");
+    for (int i = 0; i < rows; i++) {
+        fprintf(f, "%s %s %s %s %s %s\n", PQgetvalue(res, i, 0), PQgetvalue(res, i, 1), PQgetvalue(res, i, 2),
+            PQgetvalue(res, i, 3), PQgetvalue(res, i, 4), PQgetvalue(res, i, 5));
+    }
+    PQclear(res);
+    fclose(f);
+
+    printf("[export] %d commands and %d telemetry rows written to %s.commands / %s.telemetry\n", commands, rows, prefix, prefix);
+    return 0;
+}
+
+// Reads big endian int8 / float8 from a binary result column
+long long get_int8(const char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | (unsigned char)p[i];
+    return (long long)v;
+}
+
+double get_float8(const char *p) {
+    uint64_t v = (uint64_t)get_int8(p);
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+// Writes the telemetry between two epoch seconds to a compressed columnar archive for
+// telemetry_archive, so analysis can run offline. Rows are fetched a page at a time with
+// binary results: no text formatting of doubles on the server, no parsing here.
+int archive_range(PGconn *conn, long long from_s, long long to_s, const char *path, int fraction_bits) {
+    ArchiveWriter w;
+    if (!archive_writer_open(&w, path, fraction_bits)) return 1;
+
+    long long last_id = 0;
+    int ok = 1;
+    while (ok) {
+        char q[512];
+        snprintf(q, sizeof(q),
+            "SELECT id::bigint, (EXTRACT(EPOCH FROM ts) * 1000)::bigint, gas_level, battery_level, motor_speed, "
+            "motor_speed_set_point, motor_temp FROM telemetry WHERE shard_id = %d AND id > %lld "
+            "AND ts >= to_timestamp(%lld) AND ts < to_timestamp(%lld) ORDER BY id ASC LIMIT %d",
+            shard_id, last_id, from_s, to_s, ARCHIVE_PAGE_ROWS);
+        PGresult *res = PQexecParams(conn, q, 0, NULL, NULL, NULL, NULL, 1);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            fprintf(stderr, "archive select failed: %s\n", PQerrorMessage(conn));
+            PQclear(res);
+            ok = 0;
+            break;
+        }
+        int rows = PQntuples(res);
+        for (int i = 0; i < rows && ok; i++) {
+            double v[ARCHIVE_FIELDS];
+            for (int f = 0; f < ARCHIVE_FIELDS; f++) {
+                v[f] = PQgetisnull(res, i, 2 + f) ? 0.0 : get_float8(PQgetvalue(res, i, 2 + f));
+            }
+            last_id = get_int8(PQgetvalue(res, i, 0));
+            if (PQgetisnull(res, i, 1)) continue; // the range filter already drops a NULL ts
+            ok = archive_writer_append(&w, get_int8(PQgetvalue(res, i, 1)), v);
+        }
+        PQclear(res);
+        if (rows < ARCHIVE_PAGE_ROWS) break;
+    }
+
+    long long rows = w.rows;
+    int blocks = w.blocks + (w.cur.rows > 0);
+    if (!archive_writer_close(&w)) ok = 0;
+    if (!ok) { fprintf(stderr, "archive %s failed\n", path); return 1; }
+    printf("[archive] %lld telemetry rows in %d blocks written to %s\n", rows, blocks, path);
+    return 0;
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2) { fprintf(stderr, "usage: %s <client_id> [send_percent]\n", argv[0]); return 1; }
+    // Optional trailing "--shard N" picks the motor, everything before it is positional
+    if (argc >= 4 && strcmp(argv[argc - 2], "--shard") == 0) {
+        shard_id = atoi(argv[argc - 1]);
+        if (shard_id < 0) shard_id = 0;
+        argc -= 2;
+    }
+    if (argc < 2) { fprintf(stderr, "usage: %s <client_id> [send_percent [low|normal|high|critical [ttl_ms]]] [--shard N]\n", argv[0]); return 1; }
     const char *client_id = argv[1];
     double send_percent = 0;
     int will_send = 0;
-    if (argc >= 3) { will_send = 1; send_percent = atof(argv[2]); }
+    if (argc >= 3 && strcmp(argv[2], "--history") == 0 && argc < 6) {
+        fprintf(stderr, "usage: %s <client_id> --history <field> <range_s> <resolution_s>\n", argv[0]);
+        return 1;
+    }
+    if (argc >= 3 && strcmp(argv[2], "--export") == 0 && argc < 6) {
+        fprintf(stderr, "usage: %s <client_id> --export <from_epoch_s> <to_epoch_s> <prefix>\n", argv[0]);
+        return 1;
+    }
+    if (argc >= 3 && strcmp(argv[2], "--archive") == 0 && argc < 6) {
+        fprintf(stderr, "usage: %s <client_id> --archive <from_epoch_s> <to_epoch_s> <file> [fraction_bits]\n", argv[0]);
+        return 1;
+    }
+    if (argc >= 3 && strncmp(argv[2], "--", 2) != 0) { will_send = 1; send_percent = atof(argv[2]); }
+    const char *send_priority = will_send && argc >= 4 ? argv[3] : NULL;
+    const char *send_ttl_ms = will_send && argc >= 5 ? argv[4] : NULL;
 
     // Initialize and connects to the database using PQconnectdb 
     PGconn *conn = PQconnectdb(db_conninfo);
@@ -92,13 +374,41 @@ int main(int argc, char **argv) {
 
     PQclear(check_res); // Frees the memory allocated by the PGexec() function for the PGresult object.
 
+    // History query instead of live monitoring
+    if (argc >= 6 && strcmp(argv[2], "--history") == 0) {
+        int rc = print_history(conn, argv[3], atoll(argv[4]), atoll(argv[5]));
+        PQfinish(conn);
+        return rc;
+    }
+
+    // Dump a range of history for command_replay
+    if (argc >= 6 && strcmp(argv[2], "--export") == 0) {
+        int rc = export_range(conn, atoll(argv[3]), atoll(argv[4]), argv[5]);
+        PQfinish(conn);
+        return rc;
+    }
+
+    // Compressed columnar archive for offline analysis
+    if (argc >= 6 && strcmp(argv[2], "--archive") == 0) {
+        int rc = archive_range(conn, atoll(argv[3]), atoll(argv[4]), argv[5], argc >= 7 ? atoi(argv[6]) : -1);
+        PQfinish(conn);
+        return rc;
+    }
 
     if (will_send) {
-        printf("[client] sending %+.3f via TCP to controller\n", send_percent);
-        send_tcp_command(client_id, send_percent);
+        printf("[client] sending %+.3f to controller\n", send_percent);
+        send_tcp_command(client_id, send_percent, send_priority, send_ttl_ms);
     }
 
     long long last_id = 0;
+
+    // Prefer the controller's push stream; the DB is only polled if it goes away
+    int sock = subscribe_tcp_commands(client_id);
+    if (sock >= 0) {
+        stream_commands(sock, &last_id);
+        printf("[client] controller stream closed, falling back to DB polling\n");
+    }
+
     while (1) {
         char q[256];
         snprintf(q, sizeof(q), "SELECT id, client_id, percent_change, ts FROM commands WHERE id > %lld ORDER BY id ASC", last_id);
@@ -0,0 +1,144 @@
+/* command_queue.h
+   How a controller orders and schedules the pending commands of its shard, shared by the motor
+   controllers and command_replay so a replay makes the same choices the live poller made.
+   Header only, like motor_model.h. Nothing here locks or sleeps: the controllers wrap a
+   CommandHeap in their own mutex, command_replay drives one from its simulated clock.
+
+   The highest priority runs first, and the oldest (lowest id) first within a class. A command
+   whose deadline has passed is dropped wherever it sits. Low and normal commands wait out
+   COMMAND_IGNORE_MS after the last applied command; high and critical ones don't, and at
+   admission they may use HIGH_PRIORITY_RESERVE in-flight slots beyond MAX_IN_FLIGHT_COMMANDS.
+*/
+
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <stdio.h>
+#include <string.h>
+
+#define COMMAND_IGNORE_MS 200
+#define MAX_IN_FLIGHT_COMMANDS 32  // inserted but not yet processed
+#define HIGH_PRIORITY_RESERVE 8    // extra in-flight room only high and critical commands may use
+#define COMMAND_QUEUE_SIZE 64      // pending commands the poller holds in memory, by priority
+#define COMMAND_CLIENT_ID_SIZE 128
+#define PRIORITY_CLASSES 4
+#define PRIORITY_LOW 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_HIGH 2            // and above: bypasses the cooldown between commands
+#define PRIORITY_CRITICAL 3
+
+typedef struct {
+    long long id;
+    int priority;
+    long long expires_ms; // controller clock, 0 for no deadline
+    long long queued_ms;  // when it was admitted, for the wait stats
+    double percent;
+    char client_id[COMMAND_CLIENT_ID_SIZE];
+} QueuedCommand;
+
+typedef struct {
+    QueuedCommand heap[COMMAND_QUEUE_SIZE];
+    int count;
+} CommandHeap;
+
+static const char *priority_names[PRIORITY_CLASSES] = { "low", "normal", "high", "critical" };
+
+// "low", "normal", "high", "critical" or their numbers 0-3; -1 for anything else
+static inline int parse_priority(const char *s) {
+    for (int p = 0; p < PRIORITY_CLASSES; p++) {
+        if (strcmp(s, priority_names[p]) == 0) return p;
+    }
+    if (s[0] >= '0' && s[0] < '0' + PRIORITY_CLASSES && s[1] == '\0') return s[0] - '0';
+    return -1;
+}
+
+// Commands admitted so far may not exceed this for a new command of the given priority
+static inline int command_in_flight_cap(int priority) {
+    return priority >= PRIORITY_HIGH ? MAX_IN_FLIGHT_COMMANDS + HIGH_PRIORITY_RESERVE : MAX_IN_FLIGHT_COMMANDS;
+}
+
+// 1 if a runs before b
+static inline int command_before(const QueuedCommand *a, const QueuedCommand *b) {
+    if (a->priority != b->priority) return a->priority > b->priority;
+    return a->id < b->id;
+}
+
+static inline int command_expired(const QueuedCommand *c, long long now) {
+    return c->expires_ms && c->expires_ms <= now;
+}
+
+// 0 if c may be applied now, otherwise how long it still has to wait for the cooldown
+static inline long long command_cooldown_ms(const QueuedCommand *c, long long now, long long last_applied_ms) {
+    if (c->priority >= PRIORITY_HIGH) return 0;
+    long long delta = now - last_applied_ms;
+    return delta < COMMAND_IGNORE_MS ? COMMAND_IGNORE_MS - delta : 0;
+}
+
+static inline void command_heap_swap(CommandHeap *h, int i, int j) {
+    QueuedCommand t = h->heap[i];
+    h->heap[i] = h->heap[j];
+    h->heap[j] = t;
+}
+
+static inline void command_heap_up(CommandHeap *h, int i) {
+    while (i > 0 && command_before(&h->heap[i], &h->heap[(i - 1) / 2])) {
+        command_heap_swap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static inline void command_heap_down(CommandHeap *h, int i) {
+    while (1) {
+        int best = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < h->count && command_before(&h->heap[l], &h->heap[best])) best = l;
+        if (r < h->count && command_before(&h->heap[r], &h->heap[best])) best = r;
+        if (best == i) return;
+        command_heap_swap(h, i, best);
+        i = best;
+    }
+}
+
+static inline void command_heap_remove_at(CommandHeap *h, int i) {
+    h->heap[i] = h->heap[--h->count];
+    if (i < h->count) {
+        command_heap_down(h, i);
+        command_heap_up(h, i);
+    }
+}
+
+// Already queued commands are skipped. When the heap is full the command that would run last
+// makes room, or the new one is left out if it would run later still: either way it stays pending
+// in the table and comes back with a later reload.
+static inline void command_heap_insert(CommandHeap *h, const QueuedCommand *c) {
+    int worst = -1;
+    for (int i = 0; i < h->count; i++) {
+        if (h->heap[i].id == c->id) return;
+        if (worst < 0 || command_before(&h->heap[worst], &h->heap[i])) worst = i;
+    }
+    if (h->count == COMMAND_QUEUE_SIZE) {
+        if (!command_before(c, &h->heap[worst])) return;
+        command_heap_remove_at(h, worst);
+    }
+    h->heap[h->count] = *c;
+    command_heap_up(h, h->count++);
+}
+
+static inline void command_heap_remove(CommandHeap *h, long long id) {
+    for (int i = 0; i < h->count; i++) {
+        if (h->heap[i].id == id) { command_heap_remove_at(h, i); return; }
+    }
+}
+
+// Takes out a command whose deadline has passed, wherever it sits in the heap
+static inline int command_heap_take_expired(CommandHeap *h, long long now, QueuedCommand *out) {
+    for (int i = 0; i < h->count; i++) {
+        if (command_expired(&h->heap[i], now)) {
+            *out = h->heap[i];
+            command_heap_remove_at(h, i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,301 @@
+/* command_replay.c
+   Replays a recorded command history through the controller's control loop, command poller and
+   throttle in simulated time with a fixed PRNG seed, then diffs the telemetry it produces
+   against the telemetry recorded during the original run. The poller orders, expires and holds
+   back commands with the controllers' own rules from command_queue.h: priority first, deadlines,
+   and the cooldown that high and critical commands skip.
+   Compile:
+     gcc -O2 command_replay.c -o command_replay -lm
+   Usage:
+     ./client_pgsql <client_id> --export <from_epoch_s> <to_epoch_s> run     (writes run.commands, run.telemetry)
+     ./command_replay --commands run.commands [--telemetry run.telemetry] [--speed N]
+                      [--seed N] [--hz N] [--integrator euler|rk4] [--quiet]
+   --speed 1 replays at the recorded timing, N at N times that, 0 (default) as fast as possible.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include "motor_model.h"
+#include "command_queue.h"
+
+// Same cadence as the controller
+#define TELEMETRY_INTERVAL_MS 200
+#define COMMAND_POLL_INTERVAL_MS 100
+#define TELEMETRY_FIELDS 5
+
+// One recorded command. cmd.id is its line number, so commands of one class run in recorded order.
+typedef struct {
+    long long t_ms;
+    int settled; // applied or expired
+    QueuedCommand cmd;
+} ReplayCommand;
+
+// The simulated poller: its queue, the set point it drives and what it did
+typedef struct {
+    ReplayCommand *cmds;
+    int num_cmds;
+    int arrived;    // commands admitted so far, in t_ms order
+    int first_open; // every command before it is settled
+    CommandHeap pending;
+    double set_point;
+    long long last_applied_ms;
+    int applied, expired, deferred, quiet;
+} ReplayPoller;
+
+typedef struct {
+    long long t_ms;
+    double v[TELEMETRY_FIELDS]; // gas, battery, speed, set point, temp
+} TelemetryRow;
+
+const char *telemetry_fields[TELEMETRY_FIELDS] = {
+    "gas_level", "battery_level", "motor_speed", "motor_speed_set_point", "motor_temp"
+};
+
+long long mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void sleep_until_ns(long long deadline_ns) {
+    long long remaining = deadline_ns - mono_ns();
+    if (remaining <= 0) return;
+    struct timespec req = { remaining / 1000000000LL, remaining % 1000000000LL };
+    nanosleep(&req, NULL);
+}
+
+// Reads "<ms offset> <percent> [client_id [priority [expires ms offset|none]]]" lines written by
+// the clients' --export. Older exports without the last two run as normal, with no deadline.
+ReplayCommand *load_commands(const char *path, int *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return NULL; }
+    int cap = 256, n = 0;
+    ReplayCommand *cmds = malloc(sizeof(ReplayCommand) * cap);
+    char line[512];
+    while (cmds && fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        ReplayCommand c = { .cmd = { .client_id = "replay", .priority = PRIORITY_NORMAL } };
+        char priority_s[16] = "normal", expires_s[32] = "none";
+        if (sscanf(line, "%lld %lf %127s %15s %31s", &c.t_ms, &c.cmd.percent, c.cmd.client_id, priority_s, expires_s) < 2) continue;
+        int priority = parse_priority(priority_s);
+        if (priority >= 0) c.cmd.priority = priority;
+        if (strcmp(expires_s, "none") != 0) {
+            c.cmd.expires_ms = atoll(expires_s);
+            if (c.cmd.expires_ms < 1) c.cmd.expires_ms = 1; // 0 means no deadline; this one is long gone
+        }
+        c.cmd.id = n + 1;
+        c.cmd.queued_ms = c.t_ms;
+        if (n == cap) {
+            cap *= 2;
+            ReplayCommand *grown = realloc(cmds, sizeof(ReplayCommand) * cap);
+            if (!grown) { free(cmds); cmds = NULL; break; }
+            cmds = grown;
+        }
+        cmds[n++] = c;
+    }
+    fclose(f);
+    if (!cmds) { fprintf(stderr, "out of memory\n"); return NULL; }
+    *count = n;
+    return cmds;
+}
+
+// Settles a command the poller took out of the queue
+void replay_settle(ReplayPoller *p, const QueuedCommand *c) {
+    p->cmds[c->id - 1].settled = 1;
+    while (p->first_open < p->arrived && p->cmds[p->first_open].settled) p->first_open++;
+}
+
+// The periodic reload: every admitted command still pending goes back in, as the controller's
+// SELECT of unprocessed rows would bring back one that didn't fit in the queue
+void replay_reload(ReplayPoller *p) {
+    for (int i = p->first_open; i < p->arrived; i++) {
+        if (!p->cmds[i].settled) command_heap_insert(&p->pending, &p->cmds[i].cmd);
+    }
+}
+
+// poll_and_process_commands against the simulated queue. Returns how long the poller may sleep.
+long long replay_poll(ReplayPoller *p, long long t_ms) {
+    QueuedCommand c;
+    while (command_heap_take_expired(&p->pending, t_ms, &c)) {
+        replay_settle(p, &c);
+        p->expired++;
+        if (!p->quiet) printf("[replay] t=%lld ms dropped %+.3f%% from %s (%s), expired\n", t_ms, c.percent, c.client_id, priority_names[c.priority]);
+    }
+    while (p->pending.count > 0) {
+        c = p->pending.heap[0];
+        long long cooldown = command_cooldown_ms(&c, t_ms, p->last_applied_ms);
+        if (cooldown > 0) {
+            p->deferred++;
+            return cooldown;
+        }
+        command_heap_remove(&p->pending, c.id);
+        replay_settle(p, &c);
+        p->set_point = motor_apply_percent(p->set_point, c.percent);
+        p->last_applied_ms = t_ms;
+        p->applied++;
+        if (!p->quiet) printf("[replay] t=%lld ms applied %+.3f%% from %s (%s, waited %lld ms)\n",
+            t_ms, c.percent, c.client_id, priority_names[c.priority], t_ms - c.queued_ms);
+    }
+    return COMMAND_POLL_INTERVAL_MS;
+}
+
+// Reads "<ms offset> <gas> <battery> <speed> <set point> <temp>" lines
+TelemetryRow *load_telemetry(const char *path, int *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return NULL; }
+    int cap = 1024, n = 0;
+    TelemetryRow *rows = malloc(sizeof(TelemetryRow) * cap);
+    char line[512];
+    while (rows && fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        TelemetryRow r;
+        if (sscanf(line, "%lld %lf %lf %lf %lf %lf", &r.t_ms, &r.v[0], &r.v[1], &r.v[2], &r.v[3], &r.v[4]) != 6) continue;
+        if (n == cap) {
+            cap *= 2;
+            TelemetryRow *grown = realloc(rows, sizeof(TelemetryRow) * cap);
+            if (!grown) { free(rows); rows = NULL; break; }
+            rows = grown;
+        }
+        rows[n++] = r;
+    }
+    fclose(f);
+    if (!rows) { fprintf(stderr, "out of memory\n"); return NULL; }
+    *count = n;
+    return rows;
+}
+
+int main(int argc, char **argv) {
+    const char *commands_path = NULL, *telemetry_path = NULL;
+    double speed = 0;
+    uint64_t seed = 1;
+    int hz = 1000, quiet = 0;
+    Integrator integrator = INTEGRATOR_EULER;
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(a, "--quiet") == 0) { quiet = 1; continue; }
+        int ok = v != NULL;
+        if (ok && strcmp(a, "--commands") == 0) commands_path = v;
+        else if (ok && strcmp(a, "--telemetry") == 0) telemetry_path = v;
+        else if (ok && strcmp(a, "--speed") == 0) speed = atof(v);
+        else if (ok && strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else if (ok && strcmp(a, "--hz") == 0) hz = atoi(v);
+        else if (ok && strcmp(a, "--integrator") == 0) {
+            if (strcmp(v, "euler") == 0) integrator = INTEGRATOR_EULER;
+            else if (strcmp(v, "rk4") == 0) integrator = INTEGRATOR_RK4;
+            else ok = 0;
+        } else ok = 0;
+        if (!ok) {
+            commands_path = NULL;
+            break;
+        }
+        i++;
+    }
+    if (!commands_path) {
+        fprintf(stderr, "usage: %s --commands file [--telemetry file] [--speed N] [--seed N] [--hz N] [--integrator euler|rk4] [--quiet]\n", argv[0]);
+        return 1;
+    }
+    if (hz < 1) hz = 1;
+
+    int num_cmds = 0, num_rows = 0;
+    ReplayCommand *cmds = load_commands(commands_path, &num_cmds);
+    if (!cmds) return 1;
+    TelemetryRow *recorded = NULL;
+    if (telemetry_path) {
+        recorded = load_telemetry(telemetry_path, &num_rows);
+        if (!recorded) { free(cmds); return 1; }
+    }
+
+    // Start from the last recorded row before the first command (the export includes the row just
+    // before the range for this), otherwise from the controller's defaults
+    double m[TELEMETRY_FIELDS] = { 100.0, 100.0, 0.0, 100.0, 40.0 };
+    long long first_cmd_ms = num_cmds > 0 ? cmds[0].t_ms : 0;
+    for (int i = 0; i < num_rows && recorded[i].t_ms < first_cmd_ms; i++) memcpy(m, recorded[i].v, sizeof(m));
+    ReplayPoller poller = { .cmds = cmds, .num_cmds = num_cmds, .set_point = m[3], .last_applied_ms = -COMMAND_IGNORE_MS, .quiet = quiet };
+
+    long long end_ms = 0;
+    if (num_cmds > 0) end_ms = cmds[num_cmds - 1].t_ms + TELEMETRY_INTERVAL_MS;
+    if (num_rows > 0 && recorded[num_rows - 1].t_ms > end_ms) end_ms = recorded[num_rows - 1].t_ms;
+
+    PID pid = { .kp = 0.5, .ki = 0.1, .kd = 0.05, .prev_err = 0, .integral = 0 };
+    uint64_t rng = motor_rng_seed(seed);
+    double dt = 1.0 / hz;
+
+    long long last_reload_ms = -COMMAND_POLL_INTERVAL_MS, poller_wake_ms = 0, next_sample_ms = 0;
+
+    int matched = 0, rec_i = 0;
+    double sq_err[TELEMETRY_FIELDS] = { 0 }, max_err[TELEMETRY_FIELDS] = { 0 };
+
+    fprintf(stderr, "[replay] %d commands over %.1f s, seed %llu, %d Hz %s, speed %s\n",
+        num_cmds, end_ms / 1000.0, (unsigned long long)seed, hz,
+        integrator == INTEGRATOR_RK4 ? "rk4" : "euler", speed > 0 ? "paced" : "max");
+    long long wall_start = mono_ns();
+
+    long long ticks = end_ms * hz / 1000;
+    for (long long k = 0; k <= ticks; k++) {
+        long long t_ms = k * 1000 / hz;
+
+        // Ingress: a command is queued as it is admitted and wakes the poller
+        int woken = 0;
+        while (poller.arrived < num_cmds && cmds[poller.arrived].t_ms <= t_ms) {
+            command_heap_insert(&poller.pending, &cmds[poller.arrived++].cmd);
+            woken = 1;
+        }
+
+        // Command poller, as command_poller_thread: reload every poll interval, then apply what is due
+        if (woken || t_ms >= poller_wake_ms) {
+            if (t_ms - last_reload_ms >= COMMAND_POLL_INTERVAL_MS) {
+                replay_reload(&poller);
+                last_reload_ms = t_ms;
+            }
+            long long wait_ms = replay_poll(&poller, t_ms);
+            poller_wake_ms = t_ms + (wait_ms < COMMAND_POLL_INTERVAL_MS ? wait_ms : COMMAND_POLL_INTERVAL_MS);
+        }
+
+        // Control loop tick, same update as control_thread
+        m[3] = poller.set_point;
+        m[0] -= 0.1 * dt; if (m[0] < 0) m[0] = 0;
+        m[1] -= 0.05 * dt; if (m[1] < 0) m[1] = 0;
+        m[2] = motor_step(&pid, integrator, m[3], m[2], motor_noise(&rng), dt);
+        m[4] = motor_temp(m[2], &rng);
+
+        // Telemetry sample, diffed against the nearest recorded row
+        if (t_ms >= next_sample_ms) {
+            next_sample_ms += TELEMETRY_INTERVAL_MS;
+            if (!quiet) printf("%lld %.3f %.3f %.3f %.3f %.3f\n", t_ms, m[0], m[1], m[2], m[3], m[4]);
+
+            while (rec_i + 1 < num_rows && llabs(recorded[rec_i + 1].t_ms - t_ms) <= llabs(recorded[rec_i].t_ms - t_ms)) rec_i++;
+            if (num_rows > 0 && llabs(recorded[rec_i].t_ms - t_ms) <= TELEMETRY_INTERVAL_MS / 2) {
+                for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+                    double e = fabs(m[f] - recorded[rec_i].v[f]);
+                    sq_err[f] += e * e;
+                    if (e > max_err[f]) max_err[f] = e;
+                }
+                matched++;
+            }
+
+            if (speed > 0) sleep_until_ns(wall_start + (long long)(t_ms * 1000000.0 / speed));
+        }
+    }
+
+    long long wall_ms = (mono_ns() - wall_start) / 1000000LL;
+    fprintf(stderr, "[replay] done in %lld ms: %d applied, %d expired, %d poll(s) held by the cooldown, %d never applied\n",
+        wall_ms, poller.applied, poller.expired, poller.deferred, num_cmds - poller.applied - poller.expired);
+    if (telemetry_path) {
+        fprintf(stderr, "[replay] diff against %d recorded rows (%d matched):\n", num_rows, matched);
+        for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+            fprintf(stderr, "  %-22s rms=%.4f max=%.4f\n", telemetry_fields[f],
+                matched ? sqrt(sq_err[f] / matched) : 0.0, max_err[f]);
+        }
+    }
+
+    free(cmds);
+    free(recorded);
+    return 0;
+}
@@ -0,0 +1,190 @@
+/* jitter_report.c
+   Measures the control loop's tick jitter in normal mode and in real-time mode on this machine.
+   Both runs use the same tick, with busy threads standing in for the controller's database,
+   TCP and logging threads. It needs no database.
+   Compile:
+     gcc -O2 jitter_report.c -o jitter_report -lpthread -lm
+   Usage:
+     ./jitter_report [--seconds N] [--hz N] [--load N] [--mode normal|realtime|both]
+                     [--rt-priority N] [--rt-cpu N] [--integrator euler|rk4]
+   Lateness is how long after its deadline each tick woke up. Real-time mode needs CAP_SYS_NICE
+   (or an rtprio limit) and enough RLIMIT_MEMLOCK. Without them it says so and runs what it can.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdatomic.h>
+#include "motor_model.h"
+#include "realtime.h"
+
+#define LOAD_BUFFER_BYTES (1 << 20) // big enough to push the control loop out of cache
+
+typedef struct {
+    const char *name;
+    int realtime;
+    int rt_ok;        // every real-time step succeeded
+    JitterStats jitter;
+} JitterRun;
+
+int hz = 1000, seconds = 10, load_threads = -1;
+Integrator integrator = INTEGRATOR_EULER;
+RealtimeConfig rt = { .enabled = 1, .priority = RT_PRIORITY_DEFAULT, .cpu = -1 };
+atomic_int load_stop;
+
+long long mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// The controller's normal-mode sleep: relative, so the time between reading the clock and
+// sleeping counts against the tick
+void sleep_until_ns(long long deadline_ns) {
+    long long remaining = deadline_ns - mono_ns();
+    if (remaining <= 0) return;
+    struct timespec req = { remaining / 1000000000LL, remaining % 1000000000LL };
+    nanosleep(&req, NULL);
+}
+
+// Stands in for the controller's other threads: formatting and writing output, allocating,
+// sweeping memory and sleeping on short "round trips"
+void *load_thread(void *arg) {
+    FILE *sink = fopen("/dev/null", "w");
+    unsigned char *buf = malloc(LOAD_BUFFER_BYTES);
+    uint64_t rng = motor_rng_seed((uint64_t)(intptr_t)arg);
+    long long n = 0;
+    while (!atomic_load(&load_stop)) {
+        if (sink) fprintf(sink, "[telemetry] %lld %.3f\n", n, motor_noise(&rng));
+        void *p = malloc(64 + (motor_rand(&rng) & 4095));
+        free(p);
+        if (buf) memset(buf, (int)n, LOAD_BUFFER_BYTES);
+        if (++n % 16 == 0) {
+            struct timespec req = { 0, 200000 }; // 200 us, like a database round trip
+            nanosleep(&req, NULL);
+        }
+    }
+    free(buf);
+    if (sink) fclose(sink);
+    return NULL;
+}
+
+// Same tick as the controller's control_thread
+void *control_loop(void *arg) {
+    JitterRun *run = arg;
+    if (run->realtime) run->rt_ok = rt_enter_thread(&rt);
+
+    PID pid = { .kp = 0.5, .ki = 0.1, .kd = 0.05, .prev_err = 0, .integral = 0 };
+    uint64_t rng = motor_rng_seed(1);
+    double dt = 1.0 / hz, speed = 0, set_point = 100.0, gas = 100.0, battery = 100.0, temp = 40.0;
+    long long period_ns = 1000000000LL / hz;
+    long long ticks = (long long)seconds * hz;
+
+    long long next_ns = mono_ns();
+    for (long long k = 0; k < ticks; k++) {
+        gas -= 0.1 * dt; if (gas < 0) gas = 0;
+        battery -= 0.05 * dt; if (battery < 0) battery = 0;
+        speed = motor_step(&pid, integrator, set_point, speed, motor_noise(&rng), dt);
+        temp = motor_temp(speed, &rng);
+        if (k % (hz * 2) == 0) set_point = set_point > 100.0 ? 100.0 : 150.0; // keep the PID busy
+
+        next_ns += period_ns;
+        long long now = mono_ns();
+        if (now - next_ns > period_ns) {
+            run->jitter.overruns++;
+            next_ns = now;
+        }
+        if (run->realtime) rt_sleep_until_ns(next_ns);
+        else sleep_until_ns(next_ns);
+        jitter_add(&run->jitter, mono_ns() - next_ns);
+    }
+    if (temp + gas + battery < 0) printf("unreachable\n"); // keeps the model from being optimised out
+    return NULL;
+}
+
+void run_mode(JitterRun *run) {
+    jitter_reset(&run->jitter);
+    atomic_store(&load_stop, 0);
+    pthread_t *load = calloc(load_threads > 0 ? load_threads : 1, sizeof(pthread_t));
+    if (!load) { fprintf(stderr, "out of memory\n"); exit(1); }
+    for (int i = 0; i < load_threads; i++) pthread_create(&load[i], NULL, load_thread, (void *)(intptr_t)(i + 1));
+
+    fprintf(stderr, "[jitter] %s: %d s at %d Hz with %d load thread(s)\n", run->name, seconds, hz, load_threads);
+    pthread_t t;
+    pthread_create(&t, NULL, control_loop, run);
+    pthread_join(t, NULL);
+
+    atomic_store(&load_stop, 1);
+    for (int i = 0; i < load_threads; i++) pthread_join(load[i], NULL);
+    free(load);
+}
+
+void print_run(const JitterRun *run) {
+    const JitterStats *j = &run->jitter;
+    printf("%-10s %9lld %8.1f %7lld %7lld %9lld %8lld %9lld %8s\n", run->name, j->count,
+        j->count ? j->sum_ns / 1000.0 / j->count : 0.0,
+        jitter_percentile_us(j, 0.50), jitter_percentile_us(j, 0.99), jitter_percentile_us(j, 0.999),
+        j->max_ns / 1000, j->overruns, run->realtime ? (run->rt_ok ? "yes" : "partial") : "-");
+}
+
+int main(int argc, char **argv) {
+    int do_normal = 1, do_realtime = 1;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        int ok = v != NULL;
+        if (ok && strcmp(a, "--seconds") == 0) seconds = atoi(v);
+        else if (ok && strcmp(a, "--hz") == 0) hz = atoi(v);
+        else if (ok && strcmp(a, "--load") == 0) load_threads = atoi(v);
+        else if (ok && strcmp(a, "--rt-priority") == 0) rt.priority = atoi(v);
+        else if (ok && strcmp(a, "--rt-cpu") == 0) rt.cpu = atoi(v);
+        else if (ok && strcmp(a, "--mode") == 0) {
+            do_normal = strcmp(v, "normal") == 0 || strcmp(v, "both") == 0;
+            do_realtime = strcmp(v, "realtime") == 0 || strcmp(v, "both") == 0;
+            ok = do_normal || do_realtime;
+        } else if (ok && strcmp(a, "--integrator") == 0) {
+            if (strcmp(v, "euler") == 0) integrator = INTEGRATOR_EULER;
+            else if (strcmp(v, "rk4") == 0) integrator = INTEGRATOR_RK4;
+            else ok = 0;
+        } else ok = 0;
+        if (!ok) {
+            fprintf(stderr, "usage: %s [--seconds N] [--hz N] [--load N] [--mode normal|realtime|both] [--rt-priority N] [--rt-cpu N] [--integrator euler|rk4]\n", argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if (hz < 1) hz = 1;
+    if (seconds < 1) seconds = 1;
+    if (load_threads < 0) load_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    JitterRun normal = { .name = "normal", .realtime = 0 };
+    JitterRun realtime = { .name = "realtime", .realtime = 1 };
+
+    // Normal first: rt_setup_process changes the whole process (locked memory, affinity).
+    // No log flusher here: realtime.h's warnings are drained by main between runs.
+    if (do_normal) run_mode(&normal);
+    if (do_realtime) {
+        int process_ok = rt_setup_process(&rt);
+        log_drain();
+        if (rt.cpu >= 0) fprintf(stderr, "[jitter] realtime: SCHED_FIFO %d on cpu %d\n", rt.priority, rt.cpu);
+        run_mode(&realtime);
+        log_drain(); // what rt_enter_thread reported from the control thread
+        realtime.rt_ok = realtime.rt_ok && process_ok;
+    }
+
+    printf("%-10s %9s %8s %7s %7s %9s %8s %9s %8s\n",
+        "mode", "ticks", "mean_us", "p50_us", "p99_us", "p99.9_us", "max_us", "overruns", "rt_setup");
+    if (do_normal) print_run(&normal);
+    if (do_realtime) print_run(&realtime);
+    if (do_normal && do_realtime && realtime.jitter.count && normal.jitter.count) {
+        printf("p99 %lld -> %lld us, max %lld -> %lld us\n",
+            jitter_percentile_us(&normal.jitter, 0.99), jitter_percentile_us(&realtime.jitter, 0.99),
+            normal.jitter.max_ns / 1000, realtime.jitter.max_ns / 1000);
+    }
+    return 0;
+}
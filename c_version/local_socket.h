@@ -0,0 +1,99 @@
+/* local_socket.h
+   Where the controllers' per-shard Unix sockets live and who may be trusted on them, shared by
+   the motor controllers and the clients. Header only, like motor_model.h. Includers define
+   _GNU_SOURCE before their first #include, for SO_PEERCRED.
+
+   The sockets go in a directory only their owner can write: $XDG_RUNTIME_DIR/motor_controller
+   when the variable is set, otherwise /run/motor_controller (created by whoever runs the
+   controllers, e.g. a service user). A world-writable place like /tmp would let any local user
+   squat the path before the controller binds it, or answer clients in its place.
+
+   The socket itself is 0666 and its directory 0755, but $XDG_RUNTIME_DIR is 0700, so only a
+   controller serving from /run/motor_controller is reachable by other users. Under
+   $XDG_RUNTIME_DIR it serves its own user's clients and everyone else uses TCP.
+
+   Controllers only bind in a directory they own that nobody else can write. Clients only talk
+   to a socket whose directory passes the same test and whose peer runs as that directory's
+   owner (or root); anything else falls back to TCP.
+*/
+
+#ifndef LOCAL_SOCKET_H
+#define LOCAL_SOCKET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LOCAL_SOCKET_SYSTEM_DIR "/run/motor_controller"
+#define LOCAL_SOCKET_SUBDIR "motor_controller"
+#define LOCAL_SOCKET_FILE "shard%d.sock"
+
+// Candidate directories in the order they are tried; returns how many were written to dirs
+static inline int local_socket_dirs(char dirs[2][96]) {
+    int n = 0;
+    const char *xdg = getenv("XDG_RUNTIME_DIR");
+    if (xdg && xdg[0] == '/' && strlen(xdg) + sizeof(LOCAL_SOCKET_SUBDIR) + 1 < sizeof(dirs[0])) {
+        snprintf(dirs[n++], sizeof(dirs[0]), "%s/%s", xdg, LOCAL_SOCKET_SUBDIR);
+    }
+    snprintf(dirs[n++], sizeof(dirs[0]), "%s", LOCAL_SOCKET_SYSTEM_DIR);
+    return n;
+}
+
+// 1 if dir is a real directory that only its owner can write, with the owner in *owner
+static inline int local_socket_dir_private(const char *dir, uid_t *owner) {
+    struct stat st;
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || (st.st_mode & (S_IWGRP | S_IWOTH))) return 0;
+    *owner = st.st_uid;
+    return 1;
+}
+
+static inline int local_socket_addr(const char *dir, int shard, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/" LOCAL_SOCKET_FILE, dir, shard);
+    return n > 0 && (size_t)n < sizeof(addr->sun_path);
+}
+
+// Controller side: the first candidate directory this process owns, created if missing.
+// Returns 0 if there is none, in which case the controller serves TCP only.
+static inline int local_socket_server_addr(int shard, struct sockaddr_un *addr) {
+    char dirs[2][96];
+    int n = local_socket_dirs(dirs);
+    for (int i = 0; i < n; i++) {
+        if (mkdir(dirs[i], 0755) != 0 && errno != EEXIST) continue;
+        uid_t owner;
+        if (local_socket_dir_private(dirs[i], &owner) && owner == geteuid()) return local_socket_addr(dirs[i], shard, addr);
+    }
+    return 0;
+}
+
+// Client side: connects to the shard's controller socket if a trusted one exists. -1 otherwise.
+static inline int local_socket_connect(int shard) {
+    char dirs[2][96];
+    int n = local_socket_dirs(dirs);
+    for (int i = 0; i < n; i++) {
+        uid_t owner;
+        struct sockaddr_un addr;
+        if (!local_socket_dir_private(dirs[i], &owner)) continue;
+        if (!local_socket_addr(dirs[i], shard, &addr)) continue;
+        int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if (sock < 0) return -1;
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+            getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+            (cred.uid == owner || cred.uid == 0)) {
+            return sock;
+        }
+        close(sock);
+    }
+    return -1;
+}
+
+#endif
@@ -4,6 +4,7 @@
      gcc -I/usr/local/opt/libpq/include motor_controller_pgsql.c -o motor_controller_pgsql -L/usr/local/opt/libpq/lib -lpq -lpthread -lm
 */
 
+#define _GNU_SOURCE // CPU affinity in realtime.h
 #define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,19 +14,63 @@
 #include <unistd.h>
 #include <math.h>
 #include <libpq-fe.h> // postgresql library
+#include "motor_model.h"
+#include "command_queue.h"
+#include "realtime.h"
+#include "async_log.h"
+#include "local_socket.h"
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <stddef.h>
 
-void handle_client_socket(int client_fd, PGconn *conn);
+typedef struct ClientOrigin ClientOrigin;
+void handle_client_socket(int client_fd, PGconn *conn, const ClientOrigin *origin);
 
 #define TELEMETRY_INTERVAL_MS 200
+#define CONTROL_HZ_DEFAULT 1000
 #define COMMAND_POLL_INTERVAL_MS 100
-#define COMMAND_IGNORE_MS 200
 #define TCP_PORT 9090
 #define LISTEN_BACKLOG 5
 #define CLIENT_ID_SIZE 128
+#define CLIENT_RATE_PER_SEC 5.0     // the poller applies at most one command per COMMAND_IGNORE_MS
+#define CLIENT_BURST 10.0
+#define ADDRESS_RATE_PER_SEC 20.0   // several client ids may share one host
+#define ADDRESS_BURST 40.0
+#define RESERVED_RATE_PER_SEC 1.0   // high and critical commands only, once the shared bucket is empty
+#define RESERVED_BURST 5.0
+#define ADMISSION_TABLE_SIZE 512
+#define ADMISSION_KEY_SIZE (CLIENT_ID_SIZE + 32) // "rsv:id:", a client id and its uid scope
+#define FANOUT_POLL_INTERVAL_MS 100
+#define FANOUT_REPLAY_SIZE 64
+#define FANOUT_LINE_SIZE 320
+#define MAX_SUBSCRIBERS 64
+#define TELEMETRY_FIELDS 5
+#define WINDOW_QUEUE_SIZE 16 // power of two, closed windows waiting for the telemetry thread
+#define FLOAT8OID 701 // pg_type oid for DOUBLE PRECISION
+#define INT4OID 23     // pg_type oid for INTEGER
+#define ROLLUP_TIERS 3
+#define ROLLUP_STATS 4 // min, max, avg, last
+#define ROLLUP_PARAMS (2 + TELEMETRY_FIELDS * ROLLUP_STATS)
+#define ROLLUP_FLUSH_MS 5000 // an open 1 min/1 h bucket is written at least this often
+#define LEASE_TTL_MS 3000        // a dead owner's shard is taken over within LEASE_TTL_MS + LEASE_HEARTBEAT_MS
+#define LEASE_HEARTBEAT_MS 1000
+#define SHARD_OWNER_SIZE 64
+#define CHECKPOINT_INTERVAL_MS 100
+#define CHECKPOINT_MAGIC 0x504B434Du // "MCKP"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_PATH_SIZE 256
+#define JITTER_REPORT_MS 10000
+#define RT_LOG_DRAIN_MS 100
 
 typedef struct {
     double gas_level;
@@ -33,19 +78,189 @@ typedef struct {
     double motor_speed;
     double motor_speed_set_point;
     double motor_temp;
-    pthread_mutex_t lock;
+} MotorSnapshot;
+
+// Column order shared by the telemetry table and its rollups
+const char *telemetry_fields[TELEMETRY_FIELDS] = {
+    "gas_level", "battery_level", "motor_speed", "motor_speed_set_point", "motor_temp"
+};
+
+// min/max/sum/last over a run of control ticks: one telemetry window, or one rollup bucket
+typedef struct {
+    long long id; // bumps each time the control loop closes a telemetry window
+    long long end_ms; // wall clock when the window closed, picks its rollup buckets
+    int samples;
+    double min[TELEMETRY_FIELDS];
+    double max[TELEMETRY_FIELDS];
+    double sum[TELEMETRY_FIELDS];
+    double last[TELEMETRY_FIELDS];
+} MotorWindow;
+// Open bucket of one rollup tier, folded in window by window. What it gathered is upserted when
+// it closes, and every ROLLUP_FLUSH_MS before that, so a crash loses seconds of a 1 h bucket, not the hour.
+// Open bucket of one rollup tier, folded in window by window and written once when it closes
+typedef struct {
+    const char *table;
+    long long period_ms;
+    long long bucket_ms; // start of the open bucket, -1 before the first sample
+    long long flushed_ms; // when agg was last written (or the bucket opened)
+    MotorWindow agg;
+} RollupTier;
+
+const struct { const char *table; long long period_ms; } rollup_tiers[ROLLUP_TIERS] = {
+    { "telemetry_rollup_1s", 1000LL },
+    { "telemetry_rollup_1m", 60LL * 1000LL },
+    { "telemetry_rollup_1h", 3600LL * 1000LL },
+};
+
+// The control loop owns "live" and is the only writer, so it never takes a lock.
+// Readers copy "published" through a seqlock and retry if they raced a publish.
+// Set point changes go through an atomic mailbox the control loop picks up each tick.
+// The PID internals are published with each tick so a checkpoint can capture them.
+typedef struct {
+    MotorSnapshot live;
+    PID pid;                           // owned by the control loop, like live
+    MotorSnapshot published;
+    PID published_pid;
+    atomic_uint seq;                   // odd while a publish is in progress
+    _Atomic double set_point_mailbox;
 } MotorState;
 
 MotorState state;
 
+// Control loop settings, see parse_args
+int control_hz = CONTROL_HZ_DEFAULT;
+Integrator integrator = INTEGRATOR_EULER;
+uint64_t control_seed = 0; // noise seed, defaults to the start time
+RealtimeConfig realtime = { .enabled = 0, .priority = RT_PRIORITY_DEFAULT, .cpu = -1 }; // set by --realtime
+RtLogRing rt_log; // control thread -> rt_log_thread
+
+// Closed telemetry windows, control thread -> telemetry thread. Single producer, single consumer
+// like RtLogRing, but nothing is dropped: when the queue is full the control loop merges the
+// windows that don't fit into one and pushes that once the telemetry thread catches up.
+typedef struct {
+    MotorWindow slots[WINDOW_QUEUE_SIZE];
+    atomic_uint head; // next slot the control thread writes
+    atomic_uint tail; // next slot the telemetry thread reads
+} WindowQueue;
+
+WindowQueue window_queue;
+
+// Each controller process runs one shard (one motor). Several processes may be started for the
+// same shard: the one holding the shard's lease in shard_leases is active, the rest are standbys
+// that keep simulating but write nothing until the lease expires and one of them takes it over.
+int shard_id = 0;
+char shard_owner[SHARD_OWNER_SIZE]; // defaults to hostname:pid
+atomic_int lease_held = 0;
+
+// Control loop only: makes the live values visible to readers
+void motor_state_publish(MotorState *s) {
+    unsigned seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->published = s->live;
+    s->published_pid = s->pid;
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+}
+
+// Lock-free snapshot for any reader; never blocks the control loop
+void motor_state_read(MotorState *s, MotorSnapshot *out) {
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&s->seq, memory_order_acquire);
+        *out = s->published;
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+// Snapshot and PID internals from the same tick
+void motor_state_read_checkpoint(MotorState *s, MotorSnapshot *out, PID *pid) {
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&s->seq, memory_order_acquire);
+        *out = s->published;
+        *pid = s->published_pid;
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+// Control thread only: 0 if the queue is full, the window stays with the caller
+int window_queue_push(WindowQueue *q, const MotorWindow *w) {
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head - tail >= WINDOW_QUEUE_SIZE) return 0;
+    q->slots[head & (WINDOW_QUEUE_SIZE - 1)] = *w;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 1;
+}
+
+// Telemetry thread only: the oldest closed window, 0 if there is none
+int window_queue_pop(WindowQueue *q, MotorWindow *out) {
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail == head) return 0;
+    *out = q->slots[tail & (WINDOW_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+// Adds one control tick to a window
+void window_add_values(MotorWindow *w, const double v[TELEMETRY_FIELDS]) {
+    for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+        if (w->samples == 0 || v[f] < w->min[f]) w->min[f] = v[f];
+        if (w->samples == 0 || v[f] > w->max[f]) w->max[f] = v[f];
+        w->sum[f] = (w->samples == 0 ? 0 : w->sum[f]) + v[f];
+        w->last[f] = v[f];
+    }
+    w->samples++;
+}
+
+// Folds a whole window into a larger one
+void window_merge(MotorWindow *dst, const MotorWindow *src) {
+    if (src->samples == 0) return;
+    for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+        if (dst->samples == 0 || src->min[f] < dst->min[f]) dst->min[f] = src->min[f];
+        if (dst->samples == 0 || src->max[f] > dst->max[f]) dst->max[f] = src->max[f];
+        dst->sum[f] = (dst->samples == 0 ? 0 : dst->sum[f]) + src->sum[f];
+        dst->last[f] = src->last[f];
+    }
+    dst->samples += src->samples;
+}
+
+// Applies a percent change to the requested set point through the mailbox
+double motor_state_apply_percent(MotorState *s, double percent) {
+    double cur = atomic_load(&s->set_point_mailbox);
+    double next;
+    do {
+        next = motor_apply_percent(cur, percent);
+    } while (!atomic_compare_exchange_weak(&s->set_point_mailbox, &cur, next));
+    return next;
+}
+
 // PostgreSQL connection string 
 const char *db_conninfo = "host=127.0.0.1 port=5432 dbname=motordb user=motoruser password=MotorPass123!"; 
 unsigned int db_port = 5432; // Kept for reference, but included in db_conninfo
 
 long long last_processed_ms = 0;
+long long last_processed_id = 0; // under last_processed_lock, together with the set point it produced
+long long last_apply_seq = 0;    // under last_processed_lock, apply order of the last command applied
 pthread_mutex_t last_processed_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t db_init_lock = PTHREAD_MUTEX_INITIALIZER;
 
+// Command fan-out: the controller is the only reader of the commands stream and
+// pushes each new command to every subscribed client over its TCP connection.
+typedef struct {
+    char lines[FANOUT_REPLAY_SIZE][FANOUT_LINE_SIZE]; // replay ring for late joiners
+    int head;                                         // next slot to overwrite
+    int count;                                        // filled slots (<= FANOUT_REPLAY_SIZE)
+    int subscribers[MAX_SUBSCRIBERS];
+    int num_subscribers;
+    pthread_mutex_t lock;
+} CommandFanout;
+
+CommandFanout fanout = { .head = 0, .count = 0, .num_subscribers = 0, .lock = PTHREAD_MUTEX_INITIALIZER };
+
 long long now_ms() {
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
@@ -67,7 +282,7 @@ void escape_string(PGconn *conn, const char *src, char *dst, size_t dst_size) {
 
     // PQescapeString requires a buffer of size at least (2 * len + 1)
     if (len * 2 + 1 > dst_size) {
-        fprintf(stderr, "escape_string: buffer too small (src_len=%zu, dst_size=%zu)\n", len, dst_size);
+        log_error("escape_string: buffer too small (src_len=%zu, dst_size=%zu)\n", len, dst_size);
         dst[0] = '\0';
         return;
     }
@@ -76,7 +291,7 @@ void escape_string(PGconn *conn, const char *src, char *dst, size_t dst_size) {
     int out_len = PQescapeString(dst, src, len);
     
     if (out_len < 0) {
-        fprintf(stderr, "escape_string: failed to escape string\n");
+        log_error("escape_string: failed to escape string\n");
         dst[0] = '\0';
         return;
     }
@@ -99,12 +314,15 @@ int init_db(PGconn *conn) {
         "battery_level DOUBLE PRECISION,"
         "motor_speed DOUBLE PRECISION,"
         "motor_speed_set_point DOUBLE PRECISION,"
-        "motor_temp DOUBLE PRECISION)";
+        "motor_temp DOUBLE PRECISION,"
+        "shard_id INTEGER NOT NULL DEFAULT 0)";
         
     PGresult *res = PQexec(conn, telemetry_table);
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Failed to create telemetry table: %s\n", PQerrorMessage(conn));
-        PQclear(res); return 0;
+        log_error("Failed to create telemetry table: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        pthread_mutex_unlock(&db_init_lock);
+        return 0;
     }
     PQclear(res);
 
@@ -117,46 +335,472 @@ int init_db(PGconn *conn) {
         "processed SMALLINT DEFAULT 0,"
         "ts TIMESTAMP WITH TIME ZONE DEFAULT CURRENT_TIMESTAMP,"
         "processed_ts TIMESTAMP WITH TIME ZONE NULL,"
-        "processed_by VARCHAR(64) NULL)";
+        "processed_by VARCHAR(64) NULL,"
+        "shard_id INTEGER NOT NULL DEFAULT 0,"
+        "priority SMALLINT NOT NULL DEFAULT 1,"
+        "expires_ms BIGINT NULL,"
+        "status VARCHAR(16) NULL,"
+        "apply_seq BIGINT NULL)";
 
     res = PQexec(conn, commands_table);
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Failed to create commands table: %s\n", PQerrorMessage(conn));
-        PQclear(res); return 0;
+        log_error("Failed to create commands table: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        pthread_mutex_unlock(&db_init_lock);
+        return 0;
     }
     PQclear(res);
-    return 1;
+
+    for (int t = 0; t < ROLLUP_TIERS; t++) {
+        char q[2048];
+        int n = snprintf(q, sizeof(q),
+            "CREATE TABLE IF NOT EXISTS %s ("
+            "bucket_ts TIMESTAMP WITH TIME ZONE,"
+            "samples INTEGER", rollup_tiers[t].table);
+        for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+            n += snprintf(q + n, sizeof(q) - n,
+                ", %s_min DOUBLE PRECISION, %s_max DOUBLE PRECISION, %s_avg DOUBLE PRECISION, %s_last DOUBLE PRECISION",
+                telemetry_fields[f], telemetry_fields[f], telemetry_fields[f], telemetry_fields[f]);
+        }
+        snprintf(q + n, sizeof(q) - n, ", shard_id INTEGER NOT NULL DEFAULT 0, PRIMARY KEY (shard_id, bucket_ts))");
+
+        res = PQexec(conn, q);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            log_error("Failed to create %s table: %s\n", rollup_tiers[t].table, PQerrorMessage(conn));
+            PQclear(res);
+            pthread_mutex_unlock(&db_init_lock);
+            return 0;
+        }
+        PQclear(res);
+
+        // Rollup tables from before sharding are keyed on bucket_ts alone
+        snprintf(q, sizeof(q),
+            "DO $$ BEGIN "
+            "IF NOT EXISTS (SELECT 1 FROM information_schema.columns WHERE table_name = '%s' AND column_name = 'shard_id') THEN "
+            "ALTER TABLE %s ADD COLUMN shard_id INTEGER NOT NULL DEFAULT 0, DROP CONSTRAINT %s_pkey, ADD PRIMARY KEY (shard_id, bucket_ts); "
+            "END IF; END $$",
+            rollup_tiers[t].table, rollup_tiers[t].table, rollup_tiers[t].table);
+        res = PQexec(conn, q);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            log_error("Failed to add shard_id to %s: %s\n", rollup_tiers[t].table, PQerrorMessage(conn));
+            PQclear(res);
+            pthread_mutex_unlock(&db_init_lock);
+            return 0;
+        }
+        PQclear(res);
+    }
+
+    const char *shard_schema[] = {
+        "ALTER TABLE telemetry ADD COLUMN IF NOT EXISTS shard_id INTEGER NOT NULL DEFAULT 0",
+        "ALTER TABLE commands ADD COLUMN IF NOT EXISTS shard_id INTEGER NOT NULL DEFAULT 0",
+        "CREATE INDEX IF NOT EXISTS commands_pending ON commands (shard_id, processed, ts)",
+        "CREATE TABLE IF NOT EXISTS shard_leases ("
+        "shard_id INTEGER PRIMARY KEY,"
+        "owner VARCHAR(64) NOT NULL,"
+        "lease_until TIMESTAMP WITH TIME ZONE NOT NULL,"
+        "epoch BIGINT NOT NULL DEFAULT 1)",
+        // Priorities and deadlines. status is 'applied' or 'expired' once processed, NULL before
+        // and for rows processed before it existed; apply_seq orders the applied ones per shard.
+        "ALTER TABLE commands ADD COLUMN IF NOT EXISTS priority SMALLINT NOT NULL DEFAULT 1",
+        "ALTER TABLE commands ADD COLUMN IF NOT EXISTS expires_ms BIGINT NULL",
+        "ALTER TABLE commands ADD COLUMN IF NOT EXISTS status VARCHAR(16) NULL",
+        "ALTER TABLE commands ADD COLUMN IF NOT EXISTS apply_seq BIGINT NULL",
+        "CREATE INDEX IF NOT EXISTS commands_applied ON commands (shard_id, apply_seq)",
+    };
+    for (size_t i = 0; i < sizeof(shard_schema) / sizeof(shard_schema[0]); i++) {
+        res = PQexec(conn, shard_schema[i]);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            log_error("Failed to set up shard tables: %s\n", PQerrorMessage(conn));
+            PQclear(res);
+            pthread_mutex_unlock(&db_init_lock);
+            return 0;
+        }
+        PQclear(res);
+    }
 
     pthread_mutex_unlock(&db_init_lock); //release lock
+    return 1;
 }
 
-// Inserts telemetry row
-void insert_telemetry(PGconn *conn, MotorState *s) {
-    char q[512];
-    char b1[64], b2[64], b3[64], b4[64], b5[64];
-    pthread_mutex_lock(&s->lock);
-    snprintf(b1,sizeof(b1),"%.3f", s->gas_level);
-    snprintf(b2,sizeof(b2),"%.3f", s->battery_level);
-    snprintf(b3,sizeof(b3),"%.3f", s->motor_speed);
-    snprintf(b4,sizeof(b4),"%.3f", s->motor_speed_set_point);
-    snprintf(b5,sizeof(b5),"%.3f", s->motor_temp);
-    pthread_mutex_unlock(&s->lock);
+// Flattens a snapshot in telemetry_fields order
+void motor_snapshot_values(const MotorSnapshot *m, double v[TELEMETRY_FIELDS]) {
+    v[0] = m->gas_level;
+    v[1] = m->battery_level;
+    v[2] = m->motor_speed;
+    v[3] = m->motor_speed_set_point;
+    v[4] = m->motor_temp;
+}
 
+// Prepares the telemetry insert once per connection so rows go out as binary float8 params
+int prepare_telemetry_insert(PGconn *conn) {
+    const Oid types[TELEMETRY_FIELDS] = { FLOAT8OID, FLOAT8OID, FLOAT8OID, FLOAT8OID, FLOAT8OID };
+    char q[256];
     snprintf(q, sizeof(q),
-        "INSERT INTO telemetry (gas_level, battery_level, motor_speed, motor_speed_set_point, motor_temp) "
-        "VALUES (%s, %s, %s, %s, %s)",
-        b1, b2, b3, b4, b5);
+        "INSERT INTO telemetry (gas_level, battery_level, motor_speed, motor_speed_set_point, motor_temp, shard_id) "
+        "VALUES ($1, $2, $3, $4, $5, %d)", shard_id);
+    PGresult *res = PQprepare(conn, "insert_telemetry", q, TELEMETRY_FIELDS, types);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_error("Telemetry prepare failed: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        return 0;
+    }
+    PQclear(res);
+    return 1;
+}
 
-    PGresult *res = PQexec(conn, q);
+// Writes a double as a big-endian IEEE 754 float8, the binary wire format postgres expects
+void put_float8(char *dst, double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    for (int i = 7; i >= 0; i--) {
+        dst[i] = (char)(bits & 0xff);
+        bits >>= 8;
+    }
+}
+
+// Inserts telemetry row
+// The snapshot is encoded straight into the parameter buffer: no text formatting, no heap buffers.
+void insert_telemetry(PGconn *conn, const double v[TELEMETRY_FIELDS]) {
+    char buf[TELEMETRY_FIELDS][8];
+    const char *values[TELEMETRY_FIELDS];
+    int lengths[TELEMETRY_FIELDS];
+    int formats[TELEMETRY_FIELDS];
+    for (int i = 0; i < TELEMETRY_FIELDS; i++) {
+        put_float8(buf[i], v[i]);
+        values[i] = buf[i];
+        lengths[i] = 8;
+        formats[i] = 1; // binary
+    }
+
+    PGresult *res = PQexecPrepared(conn, "insert_telemetry", TELEMETRY_FIELDS, values, lengths, formats, 0);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_error("Telemetry insert failed: %s\n", PQerrorMessage(conn));
+    }
+    PQclear(res);
+}
+
+// Prepares one upsert per rollup tier. A bucket that already exists (e.g. the controller
+// restarted inside it) is merged rather than overwritten.
+int prepare_rollup_inserts(PGconn *conn, RollupTier tiers[ROLLUP_TIERS]) {
+    Oid types[ROLLUP_PARAMS];
+    types[0] = FLOAT8OID; // bucket start, epoch seconds
+    types[1] = INT4OID;   // samples
+    for (int i = 2; i < ROLLUP_PARAMS; i++) types[i] = FLOAT8OID;
+
+    for (int t = 0; t < ROLLUP_TIERS; t++) {
+        tiers[t].table = rollup_tiers[t].table;
+        tiers[t].period_ms = rollup_tiers[t].period_ms;
+        tiers[t].bucket_ms = -1;
+        tiers[t].agg.samples = 0;
+
+        char q[4096];
+        int n = snprintf(q, sizeof(q), "INSERT INTO %s VALUES (to_timestamp($1), $2", tiers[t].table);
+        for (int i = 3; i <= ROLLUP_PARAMS; i++) n += snprintf(q + n, sizeof(q) - n, ", $%d", i);
+        n += snprintf(q + n, sizeof(q) - n, ", %d) ON CONFLICT (shard_id, bucket_ts) DO UPDATE SET ", shard_id);
+        for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+            const char *c = telemetry_fields[f];
+            n += snprintf(q + n, sizeof(q) - n,
+                "%s_min = LEAST(%s.%s_min, EXCLUDED.%s_min), "
+                "%s_max = GREATEST(%s.%s_max, EXCLUDED.%s_max), "
+                "%s_avg = (%s.%s_avg * %s.samples + EXCLUDED.%s_avg * EXCLUDED.samples) / (%s.samples + EXCLUDED.samples), "
+                "%s_last = EXCLUDED.%s_last, ",
+                c, tiers[t].table, c, c,
+                c, tiers[t].table, c, c,
+                c, tiers[t].table, c, tiers[t].table, c, tiers[t].table,
+                c, c);
+        }
+        snprintf(q + n, sizeof(q) - n, "samples = %s.samples + EXCLUDED.samples", tiers[t].table);
+
+        PGresult *res = PQprepare(conn, tiers[t].table, q, ROLLUP_PARAMS, types);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            log_error("Rollup prepare failed for %s: %s\n", tiers[t].table, PQerrorMessage(conn));
+            PQclear(res);
+            return 0;
+        }
+        PQclear(res);
+    }
+    return 1;
+}
+
+// Upserts what the bucket gathered since it was last written
+void flush_rollup(PGconn *conn, const RollupTier *tier) {
+    char buf[ROLLUP_PARAMS][8];
+    const char *values[ROLLUP_PARAMS];
+    int lengths[ROLLUP_PARAMS];
+    int formats[ROLLUP_PARAMS];
+
+    const MotorWindow *agg = &tier->agg;
+    put_float8(buf[0], tier->bucket_ms / 1000.0);
+    uint32_t n = (uint32_t)agg->samples;
+    for (int i = 3; i >= 0; i--) { buf[1][i] = (char)(n & 0xff); n >>= 8; }
+    for (int f = 0; f < TELEMETRY_FIELDS; f++) {
+        put_float8(buf[2 + f * ROLLUP_STATS + 0], agg->min[f]);
+        put_float8(buf[2 + f * ROLLUP_STATS + 1], agg->max[f]);
+        put_float8(buf[2 + f * ROLLUP_STATS + 2], agg->sum[f] / agg->samples);
+        put_float8(buf[2 + f * ROLLUP_STATS + 3], agg->last[f]);
+    }
+    for (int i = 0; i < ROLLUP_PARAMS; i++) {
+        values[i] = buf[i];
+        lengths[i] = i == 1 ? 4 : 8;
+        formats[i] = 1; // binary
+    }
+
+    PGresult *res = PQexecPrepared(conn, tier->table, ROLLUP_PARAMS, values, lengths, formats, 0);
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Telemetry insert failed: %s\n", PQerrorMessage(conn));
+        log_error("Rollup insert into %s failed: %s\n", tier->table, PQerrorMessage(conn));
     }
     PQclear(res);
 }
 
-// Insert command (from TCP clients) 
-void insert_command(PGconn *conn, const char *client_id, double percent, const char *issued_via) {
-    char q[512];
+// Folds one telemetry window into every tier, flushing any bucket the window has moved past
+// and, every ROLLUP_FLUSH_MS, the part of a long bucket gathered so far.
+// O(1) per window: raw telemetry is never rescanned. Min/max see every control tick,
+// so overshoot between 200 ms telemetry rows still shows up in the rollups.
+void rollup_add_window(PGconn *conn, RollupTier tiers[ROLLUP_TIERS], long long ts_ms, const MotorWindow *w) {
+    for (int t = 0; t < ROLLUP_TIERS; t++) {
+        RollupTier *tier = &tiers[t];
+        long long bucket = ts_ms - ts_ms % tier->period_ms;
+        if (bucket != tier->bucket_ms) {
+            if (tier->agg.samples > 0) flush_rollup(conn, tier);
+            tier->bucket_ms = bucket;
+            tier->flushed_ms = ts_ms;
+            tier->agg.samples = 0;
+        }
+        window_merge(&tier->agg, w);
+        if (ts_ms - tier->flushed_ms >= ROLLUP_FLUSH_MS) { // long bucket still open: write what it has so far, the upsert merges
+            flush_rollup(conn, tier);
+            tier->flushed_ms = ts_ms;
+            tier->agg.samples = 0;
+        }
+    }
+}
+
+// Admission control at the TCP ingress: a token bucket per client_id ("id:<client_id>") and per
+// source address ("ip:<address>"), plus a global cap on commands waiting for the poller.
+// Overload is refused here, before it costs a DB write. Only the TCP server thread touches the table.
+// High and critical commands get a small reserved bucket behind each ("rsv:<key>"), so a stop is
+// not refused because routine commands used up the tokens.
+typedef struct {
+    char key[ADMISSION_KEY_SIZE];
+    int used;
+    double tokens;
+    long long last_refill_ms;
+    long long accepted;
+    long long rate_limited;
+    long long busy;
+} AdmissionEntry;
+
+AdmissionEntry admission[ADMISSION_TABLE_SIZE];
+atomic_int commands_in_flight = 0;
+
+// Finds or creates the bucket for key. When the table is full the least recently used entry is recycled.
+AdmissionEntry *admission_lookup(const char *key, double burst, long long now) {
+    unsigned h = 2166136261u; // FNV-1a
+    for (const char *c = key; *c; c++) h = (h ^ (unsigned char)*c) * 16777619u;
+
+    AdmissionEntry *oldest = NULL;
+    for (int i = 0; i < ADMISSION_TABLE_SIZE; i++) {
+        AdmissionEntry *e = &admission[(h + i) % ADMISSION_TABLE_SIZE];
+        if (e->used && strcmp(e->key, key) == 0) return e;
+        if (!e->used) { oldest = e; break; }
+        if (!oldest || e->last_refill_ms < oldest->last_refill_ms) oldest = e;
+    }
+
+    memset(oldest, 0, sizeof(*oldest));
+    snprintf(oldest->key, sizeof(oldest->key), "%s", key);
+    oldest->used = 1;
+    oldest->tokens = burst;
+    oldest->last_refill_ms = now;
+    return oldest;
+}
+
+// Refills the bucket for the time elapsed; 1 if it has a token to take
+int admission_refill(AdmissionEntry *e, double rate_per_sec, double burst, long long now) {
+    e->tokens += (now - e->last_refill_ms) * rate_per_sec / 1000.0;
+    if (e->tokens > burst) e->tokens = burst;
+    e->last_refill_ms = now;
+    return e->tokens >= 1.0;
+}
+
+// Refills the bucket and takes one token if there is one
+int admission_take(AdmissionEntry *e, double rate_per_sec, double burst, long long now) {
+    if (!admission_refill(e, rate_per_sec, burst, now)) return 0;
+    e->tokens -= 1.0;
+    return 1;
+}
+
+// Second bucket behind key that only high and critical commands draw on, once key's own is empty:
+// a client or host that spent its tokens on routine changes can still get an emergency stop in.
+AdmissionEntry *admission_reserve(const char *key, long long now) {
+    char rsv_key[ADMISSION_KEY_SIZE + 4];
+    snprintf(rsv_key, sizeof(rsv_key), "rsv:%s", key);
+    return admission_lookup(rsv_key, RESERVED_BURST, now);
+}
+
+// Sets the in-flight count from the commands of this shard still waiting in the table
+void seed_in_flight(PGconn *conn) {
+    char q[128];
+    snprintf(q, sizeof(q), "SELECT COUNT(*) FROM commands WHERE processed = 0 AND shard_id = %d", shard_id);
+    PGresult *res = PQexec(conn, q);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        atomic_store(&commands_in_flight, atoi(PQgetvalue(res, 0, 0)));
+    }
+    PQclear(res);
+}
+
+// Called by the poller once a command is marked processed
+void in_flight_done() {
+    int cur = atomic_load(&commands_in_flight);
+    while (cur > 0 && !atomic_compare_exchange_weak(&commands_in_flight, &cur, cur - 1));
+}
+
+// Pending commands of this shard, highest priority first and oldest first within a class.
+// The ingress thread pushes each command it admits and wakes the poller, so a critical command is
+// claimed on arrival rather than at the next poll. The poller also reloads the pending rows every
+// COMMAND_POLL_INTERVAL_MS, for commands admitted by another controller of the shard or left by an
+// earlier run. Only the poller takes commands out; the lease thread empties the queue on lease loss.
+typedef struct {
+    CommandHeap pending; // ordered as command_queue.h says
+    int wake; // a push since the poller last went to sleep
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} CommandQueue;
+
+CommandQueue command_queue = { .pending = { .count = 0 }, .wake = 0, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// Per priority class, for STATS. The wait runs from admission to the claim.
+typedef struct {
+    atomic_llong applied;
+    atomic_llong expired;
+    atomic_llong wait_total_ms;
+    atomic_llong wait_max_ms;
+} PriorityStats;
+
+PriorityStats priority_stats[PRIORITY_CLASSES];
+atomic_llong next_apply_seq = 0; // last apply_seq handed out, seeded from the table on lease acquisition
+
+// Ingress side: queues a freshly admitted command and wakes the poller
+void command_queue_push(CommandQueue *q, const QueuedCommand *c) {
+    pthread_mutex_lock(&q->lock);
+    command_heap_insert(&q->pending, c);
+    q->wake = 1;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Copies the command to run next without taking it out
+int command_queue_peek(CommandQueue *q, QueuedCommand *out) {
+    pthread_mutex_lock(&q->lock);
+    int found = q->pending.count > 0;
+    if (found) *out = q->pending.heap[0];
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+void command_queue_remove(CommandQueue *q, long long id) {
+    pthread_mutex_lock(&q->lock);
+    command_heap_remove(&q->pending, id);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Takes out a command whose deadline has passed, wherever it sits in the queue
+int command_queue_take_expired(CommandQueue *q, long long now, QueuedCommand *out) {
+    pthread_mutex_lock(&q->lock);
+    int found = command_heap_take_expired(&q->pending, now, out);
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+void command_queue_clear(CommandQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->pending.count = 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Poller side: sleeps until a push or for timeout_ms
+void command_queue_wait(CommandQueue *q, long timeout_ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    pthread_mutex_lock(&q->lock);
+    if (!q->wake) pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+    q->wake = 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Loads the best pending commands of this shard from the table
+void command_queue_reload(PGconn *conn, CommandQueue *q) {
+    char sql[320];
+    snprintf(sql, sizeof(sql),
+        "SELECT id, priority, COALESCE(expires_ms, 0), (EXTRACT(EPOCH FROM ts) * 1000)::bigint, percent_change, client_id "
+        "FROM commands WHERE processed = 0 AND shard_id = %d ORDER BY priority DESC, id ASC LIMIT %d",
+        shard_id, COMMAND_QUEUE_SIZE);
+    PGresult *res = PQexec(conn, sql);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_error("Command reload failed: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        return;
+    }
+    pthread_mutex_lock(&q->lock);
+    for (int i = 0; i < PQntuples(res); i++) {
+        QueuedCommand c = { .id = atoll(PQgetvalue(res, i, 0)), .priority = atoi(PQgetvalue(res, i, 1)) };
+        if (c.priority < PRIORITY_LOW) c.priority = PRIORITY_LOW;
+        if (c.priority > PRIORITY_CRITICAL) c.priority = PRIORITY_CRITICAL;
+        c.expires_ms = atoll(PQgetvalue(res, i, 2));
+        c.queued_ms = atoll(PQgetvalue(res, i, 3));
+        c.percent = atof(PQgetvalue(res, i, 4));
+        snprintf(c.client_id, sizeof(c.client_id), "%s", PQgetvalue(res, i, 5));
+        command_heap_insert(&q->pending, &c);
+    }
+    pthread_mutex_unlock(&q->lock);
+    PQclear(res);
+}
+
+void priority_stats_wait(PriorityStats *p, long long wait_ms) {
+    if (wait_ms < 0) wait_ms = 0;
+    atomic_fetch_add(&p->wait_total_ms, wait_ms);
+    long long max = atomic_load(&p->wait_max_ms);
+    while (wait_ms > max && !atomic_compare_exchange_weak(&p->wait_max_ms, &max, wait_ms));
+}
+
+// Replies to "STATS" with one line of counters per known client and address, and per priority class
+void admission_write_stats(int client_fd) {
+    char line[256];
+    snprintf(line, sizeof(line), "in_flight=%d max=%d high_priority_reserve=%d\n",
+        atomic_load(&commands_in_flight), MAX_IN_FLIGHT_COMMANDS, HIGH_PRIORITY_RESERVE);
+    write(client_fd, line, strlen(line));
+    for (int p = PRIORITY_CRITICAL; p >= PRIORITY_LOW; p--) {
+        PriorityStats *ps = &priority_stats[p];
+        long long applied = atomic_load(&ps->applied);
+        snprintf(line, sizeof(line), "priority:%s applied=%lld expired=%lld avg_wait_ms=%lld max_wait_ms=%lld\n",
+            priority_names[p], applied, atomic_load(&ps->expired),
+            applied ? atomic_load(&ps->wait_total_ms) / applied : 0, atomic_load(&ps->wait_max_ms));
+        write(client_fd, line, strlen(line));
+    }
+    for (int i = 0; i < ADMISSION_TABLE_SIZE; i++) {
+        AdmissionEntry *e = &admission[i];
+        if (!e->used) continue;
+        snprintf(line, sizeof(line), "%.*s accepted=%lld rate_limited=%lld busy=%lld\n",
+            (int)sizeof(e->key), e->key, e->accepted, e->rate_limited, e->busy); // key is bounded, the counters always fit
+        write(client_fd, line, strlen(line));
+    }
+}
+
+void reply_and_close(int client_fd, const char *message) {
+    write(client_fd, message, strlen(message));
+    close(client_fd);
+}
+
+// Counts a refusal against key's bucket, looked up again as a lookup since may have recycled it
+void admission_refuse(int client_fd, const char *key, double burst, long long now) {
+    admission_lookup(key, burst, now)->rate_limited++;
+    reply_and_close(client_fd, "Rate limited\n");
+}
+
+// Insert command (from TCP clients), returns its id or 0
+long long insert_command(PGconn *conn, const char *client_id, double percent, const char *issued_via, int priority, long long expires_ms) {
     char percent_s[64];
     snprintf(percent_s, sizeof(percent_s), "%.6f", percent);
 
@@ -164,90 +808,101 @@ void insert_command(PGconn *conn, const char *client_id, double percent, const c
     escape_string(conn, client_id ? client_id : "tcp_client", esc_client, sizeof(esc_client));
     escape_string(conn, issued_via ? issued_via : "tcp", esc_via, sizeof(esc_via));
 
+    char expires_s[32] = "NULL";
+    if (expires_ms) snprintf(expires_s, sizeof(expires_s), "%lld", expires_ms);
+
+    char q[sizeof(esc_client) + sizeof(esc_via) + 256]; // both escaped strings at full length fit
     snprintf(q, sizeof(q),
-        "INSERT INTO commands (client_id, percent_change, issued_via) VALUES ('%s', %s, '%s')",
-        esc_client, percent_s, esc_via);
+        "INSERT INTO commands (client_id, percent_change, issued_via, shard_id, priority, expires_ms) "
+        "VALUES ('%s', %s, '%s', %d, %d, %s) RETURNING id",
+        esc_client, percent_s, esc_via, shard_id, priority, expires_s);
 
     // Replaced pgsql_query and pgsql_error with PQexec and proper status check 
     PGresult *res = PQexec(conn, q);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Command insert failed: %s\n", PQerrorMessage(conn));
+    long long id = 0;
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        id = atoll(PQgetvalue(res, 0, 0));
+    } else {
+        log_error("Command insert failed: %s\n", PQerrorMessage(conn));
     }
     PQclear(res);
+    return id;
 }
 
-// Poll and process commands 
-void poll_and_process_commands(PGconn *conn, MotorState *s) {
-    const char *select_q = "SELECT id, client_id, percent_change, ts FROM commands WHERE processed = 0 ORDER BY ts ASC LIMIT 1";    
-
-    PGresult *res = PQexec(conn, select_q);
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) { // Check for successful SELECT
-        fprintf(stderr, "Command select failed: %s\n", PQerrorMessage(conn));
-        PQclear(res);
-        return;
+// Marks a queued command 'applied' or 'expired'. As with the old claim, the row must still be
+// pending and the lease still ours, which fences off an owner whose lease has already expired
+// even if it hasn't noticed yet. Returns 1 if this call settled it.
+int settle_command(PGconn *conn, long long id, const char *status, long long apply_seq) {
+    char shard_s[16], id_s[24], seq_s[24];
+    snprintf(shard_s, sizeof(shard_s), "%d", shard_id);
+    snprintf(id_s, sizeof(id_s), "%lld", id);
+    snprintf(seq_s, sizeof(seq_s), "%lld", apply_seq);
+    const char *params[5] = { shard_s, shard_owner, id_s, status, apply_seq ? seq_s : NULL };
+    PGresult *res = PQexecParams(conn,
+        "UPDATE commands SET processed = 1, status = $4, apply_seq = $5::bigint, "
+        "processed_ts = CURRENT_TIMESTAMP, processed_by = $2 "
+        "WHERE id = $3::bigint AND shard_id = $1::int AND processed = 0 "
+        "AND EXISTS (SELECT 1 FROM shard_leases WHERE shard_id = $1::int AND owner = $2 AND lease_until > CURRENT_TIMESTAMP)",
+        5, NULL, params, NULL, NULL, 0);
+    int settled = 0;
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_error("Command %s update failed: %s\n", status, PQerrorMessage(conn));
+    } else {
+        settled = atoi(PQcmdTuples(res)) == 1;
     }
+    PQclear(res);
+    return settled;
+}
 
-    int rows = PQntuples(res);
-    if (rows == 0) { // No commands found
-        PQclear(res);
-        return;
-    }
+void expire_command(PGconn *conn, const QueuedCommand *c, long long now) {
+    if (!settle_command(conn, c->id, "expired", 0)) return; // settled elsewhere, or the lease is gone
+    in_flight_done();
+    atomic_fetch_add(&priority_stats[c->priority].expired, 1);
+    log_warn("[controller] dropped command id=%lld from=%s priority=%s, expired %lld ms ago\n",
+        c->id, c->client_id, priority_names[c->priority], now - c->expires_ms);
+}
 
-    char *id = PQgetvalue(res, 0, 0);          
-    char *client_id = PQgetvalue(res, 0, 1);
-    char *percent = PQgetvalue(res, 0, 2);
+// Poll and process commands: best queued command first. Expired commands are dropped wherever
+// they sit in the queue. Low and normal commands wait out the cooldown after the last command,
+// high and critical ones don't. Returns how long the poller may sleep before a command is due.
+long poll_and_process_commands(PGconn *conn, MotorState *s) {
+    if (!atomic_load(&lease_held)) return COMMAND_POLL_INTERVAL_MS; // standby
 
     long long now = now_ms();
-    pthread_mutex_lock(&last_processed_lock);
-    long long delta = now - last_processed_ms;
-    if (delta < COMMAND_IGNORE_MS) {
-        pthread_mutex_unlock(&last_processed_lock);
-        PQclear(res); // Clear the select result before returning
-        return; // Skip command
-    }
-    pthread_mutex_unlock(&last_processed_lock);
+    QueuedCommand c;
+    while (command_queue_take_expired(&command_queue, now, &c)) expire_command(conn, &c, now);
 
-    double p = atof(percent);
-    pthread_mutex_lock(&s->lock);
-    s->motor_speed_set_point += s->motor_speed_set_point * (p / 100.0);
-    if (s->motor_speed_set_point < 0) s->motor_speed_set_point = 0;
-    if (s->motor_speed_set_point > 10000) s->motor_speed_set_point = 10000;
-    pthread_mutex_unlock(&s->lock);
-
-    char uq[256];
-    snprintf(uq, sizeof(uq),
-         "UPDATE commands SET processed=1, processed_ts = CURRENT_TIMESTAMP, processed_by = 'motor_controller' WHERE id = %s",
-         id);
-         
-    // Execute the updated query
-    PGresult *update_res = PQexec(conn, uq); // Use a new result variable for the update
-    if (PQresultStatus(update_res) != PGRES_COMMAND_OK) {
-     fprintf(stderr, "Failed to mark processed: %s\n", PQerrorMessage(conn));
-    }
-    PQclear(update_res); // Clear the updated result
+    while (command_queue_peek(&command_queue, &c)) {
+        if (command_expired(&c, now)) {
+            command_queue_remove(&command_queue, c.id);
+            expire_command(conn, &c, now);
+            continue;
+        }
+        pthread_mutex_lock(&last_processed_lock);
+        long long cooldown = command_cooldown_ms(&c, now, last_processed_ms);
+        pthread_mutex_unlock(&last_processed_lock);
+        if (cooldown > 0) return cooldown; // stays queued
 
-    pthread_mutex_lock(&last_processed_lock);
-    last_processed_ms = now;
-    pthread_mutex_unlock(&last_processed_lock);
+        command_queue_remove(&command_queue, c.id);
+        long long seq = atomic_fetch_add(&next_apply_seq, 1) + 1;
+        if (!settle_command(conn, c.id, "applied", seq)) continue; // settled elsewhere, or the lease is gone
 
-    printf("[controller] applied command id=%s from=%s percent=%s at ms=%lld\n", id, client_id, percent, now);
-    
-    PQclear(res); 
-}
-
-//PID struct
-typedef struct {
-    double kp, ki, kd;
-    double prev_err;
-    double integral;
-} PID;
+        // Set point, command and time change together so a checkpoint never sees one without the others
+        pthread_mutex_lock(&last_processed_lock);
+        motor_state_apply_percent(s, c.percent);
+        last_processed_id = c.id;
+        last_apply_seq = seq;
+        last_processed_ms = now;
+        pthread_mutex_unlock(&last_processed_lock);
+        in_flight_done();
+        atomic_fetch_add(&priority_stats[c.priority].applied, 1);
+        priority_stats_wait(&priority_stats[c.priority], now - c.queued_ms);
 
-double pid_step(PID *pid, double setpoint, double measure, double dt) {
-    double err = setpoint - measure;
-    pid->integral += err * dt;
-    double derivative = dt > 0 ? (err - pid->prev_err) / dt : 0;
-    pid->prev_err = err;
-    return pid->kp * err + pid->ki * pid->integral + pid->kd * derivative;
+        log_info("[controller] applied command id=%lld from=%s percent=%.6f priority=%s after %lld ms at ms=%lld\n",
+            c.id, c.client_id, c.percent, priority_names[c.priority], now - c.queued_ms, now);
+        now = now_ms();
+    }
+    return COMMAND_POLL_INTERVAL_MS;
 }
 
 // New PostgreSQL Connection Function
@@ -257,34 +912,147 @@ PGconn *thread_db_connect() {
     
     // Checks connection status
     if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Thread DB connection failed: %s\n", PQerrorMessage(conn));
+        log_error("Thread DB connection failed: %s\n", PQerrorMessage(conn));
         PQfinish(conn);
         return NULL;
     }
     return conn;
 }
 
-// Telemetry thread 
+long long mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Sleeps until an absolute CLOCK_MONOTONIC deadline so the control rate doesn't drift
+void sleep_until_ns(long long deadline_ns) {
+    long long remaining = deadline_ns - mono_ns();
+    if (remaining <= 0) return;
+    struct timespec req = { remaining / 1000000000LL, remaining % 1000000000LL };
+    nanosleep(&req, NULL);
+}
+
+// Control thread: physics and PID at control_hz, no database work
+// Every TELEMETRY_INTERVAL_MS worth of ticks it closes a window of per-tick aggregates and queues it.
+void *control_thread(void *arg) {
+    log_thread_name("control");
+    PID *pid = &state.pid; // gains and any restored internals are set up by main
+    double dt = 1.0 / control_hz;
+    long long period_ns = 1000000000LL / control_hz;
+    int ticks_per_window = control_hz * TELEMETRY_INTERVAL_MS / 1000;
+    if (ticks_per_window < 1) ticks_per_window = 1;
+    uint64_t rng = motor_rng_seed(control_seed);
+
+    MotorWindow window = { .id = 0, .samples = 0 };
+    MotorWindow carry = { .id = 0, .samples = 0 }; // closed windows the queue had no room for
+    JitterStats jitter;
+    jitter_reset(&jitter);
+    if (realtime.enabled && !rt_enter_thread(&realtime)) {
+        log_warn("[realtime] control loop continues with what could be set up\n");
+    }
+    long long next_ns = mono_ns();
+    long long report_ns = next_ns + JITTER_REPORT_MS * 1000000LL;
+
+    while (1) {
+        MotorSnapshot *m = &state.live; // sole writer, no lock
+        m->motor_speed_set_point = atomic_load(&state.set_point_mailbox);
+        m->gas_level -= 0.1 * dt; if (m->gas_level < 0) m->gas_level = 0;
+        m->battery_level -= 0.05 * dt; if (m->battery_level < 0) m->battery_level = 0;
+        m->motor_speed = motor_step(pid, integrator, m->motor_speed_set_point, m->motor_speed, motor_noise(&rng), dt);
+        m->motor_temp = motor_temp(m->motor_speed, &rng);
+
+        double v[TELEMETRY_FIELDS];
+        motor_snapshot_values(m, v);
+        window_add_values(&window, v);
+        if (window.samples >= ticks_per_window) {
+            window.id++;
+            window.end_ms = now_ms();
+            if (carry.samples > 0) { // the telemetry thread is behind: fold into the backlog, keep order
+                window_merge(&carry, &window);
+                carry.id = window.id;
+                carry.end_ms = window.end_ms;
+                if (window_queue_push(&window_queue, &carry)) carry.samples = 0;
+            } else if (!window_queue_push(&window_queue, &window)) {
+                carry = window;
+            }
+            window.samples = 0;
+        }
+        motor_state_publish(&state);
+
+        next_ns += period_ns;
+        long long now = mono_ns();
+        if (now - next_ns > period_ns) {
+            jitter.overruns++;
+            if (realtime.enabled) {
+                RtLogRecord rec = { .kind = RT_LOG_OVERRUN, .t_ns = now, .v = { now - next_ns } };
+                rt_log_push(&rt_log, &rec); // no printf on the tick, rt_log_thread reports it
+            }
+            next_ns = now; // fell behind, don't burst to catch up
+        }
+        if (realtime.enabled) rt_sleep_until_ns(next_ns);
+        else sleep_until_ns(next_ns);
+
+        long long woke = mono_ns();
+        jitter_add(&jitter, woke - next_ns);
+        if (woke >= report_ns) {
+            rt_log_jitter(&rt_log, woke, &jitter);
+            jitter_reset(&jitter);
+            report_ns += JITTER_REPORT_MS * 1000000LL;
+        }
+    }
+    return NULL;
+}
+
+// Logs what the control thread queued on rt_log, which stays free of format parsing and clock reads
+void *rt_log_thread(void *arg) {
+    log_thread_name("rt_log");
+    unsigned reported_drops = 0;
+    while (1) {
+        RtLogRecord rec;
+        while (rt_log_pop(&rt_log, &rec)) {
+            if (rec.kind == RT_LOG_OVERRUN) {
+                log_warn("[realtime] control tick started %lld us late\n", rec.v[0] / 1000);
+            } else {
+                log_info("[jitter] %lld ticks at %d Hz (%s): p50 %lld us, p99 %lld us, p99.9 %lld us, max %lld us, %lld overruns\n",
+                    rec.v[0], control_hz, realtime.enabled ? "realtime" : "normal", rec.v[1], rec.v[2], rec.v[3], rec.v[4], rec.v[5]);
+            }
+        }
+        unsigned drops = atomic_load(&rt_log.dropped);
+        if (drops != reported_drops) {
+            log_warn("[realtime] %u log records dropped, ring full\n", drops - reported_drops);
+            reported_drops = drops;
+        }
+        msleep(RT_LOG_DRAIN_MS);
+    }
+    return NULL;
+}
+
+// Telemetry thread: decimated publisher, one row and one window every TELEMETRY_INTERVAL_MS
 void *telemetry_thread(void *arg) {
+    log_thread_name("telemetry");
     PGconn *conn = thread_db_connect();
     if (!conn) return NULL;
     if (!init_db(conn)) return NULL;
-
-    PID pid = { .kp = 0.5, .ki = 0.1, .kd = 0.05, .prev_err = 0, .integral = 0 };
-    double dt = 0.2;
+    if (!prepare_telemetry_insert(conn)) return NULL;
+    RollupTier tiers[ROLLUP_TIERS];
+    if (!prepare_rollup_inserts(conn, tiers)) return NULL;
 
     while (1) {
-        pthread_mutex_lock(&state.lock);
-        state.gas_level -= 0.02; if (state.gas_level < 0) state.gas_level = 0;
-        state.battery_level -= 0.01; if (state.battery_level < 0) state.battery_level = 0;
-        double control = pid_step(&pid, state.motor_speed_set_point, state.motor_speed, dt);
-        double noise = ((rand() % 100) - 50) / 100.0;
-        state.motor_speed += (control * 0.1 + noise) * dt;
-        if (state.motor_speed < 0) state.motor_speed = 0;
-        state.motor_temp = 20.0 + state.motor_speed * 0.01 + ((rand()%100)/100.0 - 0.5);
-        pthread_mutex_unlock(&state.lock);
-
-        insert_telemetry(conn, &state);
+        MotorSnapshot snap;
+        MotorWindow window;
+        double v[TELEMETRY_FIELDS];
+        motor_state_read(&state, &snap);
+        motor_snapshot_values(&snap, v);
+        if (!atomic_load(&lease_held)) { // standbys don't report a motor they don't own
+            while (window_queue_pop(&window_queue, &window)) { } // nor roll it up
+            msleep(TELEMETRY_INTERVAL_MS);
+            continue;
+        }
+        insert_telemetry(conn, v);
+        while (window_queue_pop(&window_queue, &window)) { // every closed window, in order, none skipped
+            rollup_add_window(conn, tiers, window.end_ms, &window);
+        }
         msleep(TELEMETRY_INTERVAL_MS);
     }
 
@@ -293,42 +1061,474 @@ void *telemetry_thread(void *arg) {
 }
 
 // Command poller thread 
+// Takes or renews the shard's lease. The row is only updated while this process owns it or
+// after it expired, and the epoch bumps on every change of owner. Time comes from the database
+// clock so hosts don't need synchronised clocks. Returns the epoch, or 0 if someone else holds it.
+long long lease_renew(PGconn *conn) {
+    char shard_s[16], ttl_s[16];
+    snprintf(shard_s, sizeof(shard_s), "%d", shard_id);
+    snprintf(ttl_s, sizeof(ttl_s), "%d", LEASE_TTL_MS);
+    const char *params[3] = { shard_s, shard_owner, ttl_s };
+    PGresult *res = PQexecParams(conn,
+        "INSERT INTO shard_leases (shard_id, owner, lease_until) "
+        "VALUES ($1::int, $2, CURRENT_TIMESTAMP + $3::int * interval '1 millisecond') "
+        "ON CONFLICT (shard_id) DO UPDATE SET owner = EXCLUDED.owner, lease_until = EXCLUDED.lease_until, "
+        "epoch = shard_leases.epoch + CASE WHEN shard_leases.owner = EXCLUDED.owner THEN 0 ELSE 1 END "
+        "WHERE shard_leases.owner = EXCLUDED.owner OR shard_leases.lease_until < CURRENT_TIMESTAMP "
+        "RETURNING epoch",
+        3, NULL, params, NULL, NULL, 0);
+    long long epoch = 0;
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_error("Lease renew failed: %s\n", PQerrorMessage(conn));
+    } else if (PQntuples(res) == 1) {
+        epoch = atoll(PQgetvalue(res, 0, 0));
+    }
+    PQclear(res);
+    return epoch;
+}
+
+// Picks up the set point the previous owner last reported, so a failover doesn't reset the motor
+void resume_shard_set_point(PGconn *conn, MotorState *s) {
+    char q[160];
+    snprintf(q, sizeof(q),
+        "SELECT motor_speed_set_point FROM telemetry WHERE shard_id = %d ORDER BY id DESC LIMIT 1", shard_id);
+    PGresult *res = PQexec(conn, q);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        double set_point = atof(PQgetvalue(res, 0, 0));
+        atomic_store(&s->set_point_mailbox, set_point);
+        log_info("[lease] resumed shard %d at set point %.3f\n", shard_id, set_point);
+    }
+    PQclear(res);
+}
+
+// Warm restart: the owner of a shard saves the controller state to a small local file every
+// CHECKPOINT_INTERVAL_MS, and main restores it so a restart picks up where the last run left off
+// instead of re-converging from the defaults.
+typedef struct {
+    uint32_t magic, version;
+    int32_t shard_id;
+    char owner[SHARD_OWNER_SIZE];
+    long long saved_ms;
+    MotorSnapshot motor;
+    PID pid;
+    double set_point;            // mailbox value, includes every command up to last_apply_seq
+    long long last_processed_id;
+    long long last_apply_seq;
+    long long last_processed_ms;
+    uint64_t checksum;           // FNV-1a of everything above
+} ControllerCheckpoint;
+
+char checkpoint_path[CHECKPOINT_PATH_SIZE] = ""; // empty disables checkpoints
+int checkpoint_restored = 0;
+
+uint64_t checkpoint_checksum(const ControllerCheckpoint *c) {
+    uint64_t h = 1469598103934665603ULL;
+    const unsigned char *p = (const unsigned char *)c;
+    for (size_t i = 0; i < offsetof(ControllerCheckpoint, checksum); i++) h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Written to a temporary file and renamed over the old one, so a crash mid-write leaves the
+// previous checkpoint intact
+int checkpoint_write(const char *path, MotorState *s) {
+    ControllerCheckpoint c;
+    memset(&c, 0, sizeof(c)); // padding is part of the checksum
+    c.magic = CHECKPOINT_MAGIC;
+    c.version = CHECKPOINT_VERSION;
+    c.shard_id = shard_id;
+    snprintf(c.owner, sizeof(c.owner), "%s", shard_owner);
+    c.saved_ms = now_ms();
+    pthread_mutex_lock(&last_processed_lock);
+    c.set_point = atomic_load(&s->set_point_mailbox);
+    c.last_processed_id = last_processed_id;
+    c.last_apply_seq = last_apply_seq;
+    c.last_processed_ms = last_processed_ms;
+    pthread_mutex_unlock(&last_processed_lock);
+    motor_state_read_checkpoint(s, &c.motor, &c.pid);
+    c.checksum = checkpoint_checksum(&c);
+
+    char tmp[CHECKPOINT_PATH_SIZE + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { log_error("%s: %s", tmp, strerror(errno)); return 0; }
+    int ok = write(fd, &c, sizeof(c)) == (ssize_t)sizeof(c) && fsync(fd) == 0;
+    if (close(fd) != 0) ok = 0;
+    if (ok && rename(tmp, path) != 0) { log_error("%s: %s", path, strerror(errno)); ok = 0; }
+    return ok;
+}
+
+int checkpoint_load(const char *path, ControllerCheckpoint *c) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0; // first run
+    ssize_t n = read(fd, c, sizeof(*c));
+    close(fd);
+    if (n != (ssize_t)sizeof(*c) || c->magic != CHECKPOINT_MAGIC || c->version != CHECKPOINT_VERSION ||
+        c->checksum != checkpoint_checksum(c)) {
+        log_warn("[checkpoint] %s is not a valid checkpoint, starting fresh\n", path);
+        return 0;
+    }
+    if (c->shard_id != shard_id) {
+        log_warn("[checkpoint] %s is for shard %d, not %d, starting fresh\n", path, c->shard_id, shard_id);
+        return 0;
+    }
+    return 1;
+}
+
+// Called from main before any thread starts
+void checkpoint_restore(const ControllerCheckpoint *c, MotorState *s) {
+    s->live = c->motor;
+    s->live.motor_speed_set_point = c->set_point;
+    s->pid = c->pid;
+    atomic_store(&s->set_point_mailbox, c->set_point);
+    last_processed_id = c->last_processed_id;
+    last_apply_seq = c->last_apply_seq;
+    last_processed_ms = c->last_processed_ms;
+    checkpoint_restored = 1;
+    log_info("[checkpoint] restored shard %d from %lld ms ago: speed %.3f, set point %.3f, last command id %lld\n",
+        shard_id, now_ms() - c->saved_ms, c->motor.motor_speed, c->set_point, c->last_processed_id);
+}
+
+// The checkpoint's owner name lets a restart renew its own lease at once. Only one process may
+// take it, and only once the process it was made for ("host:pid") is gone, or two controllers
+// would renew the same lease. An flock on <checkpoint>.lock, held until exit, settles the first.
+int checkpoint_owner_reusable(const char *owner) {
+    char lock_path[CHECKPOINT_PATH_SIZE + 8];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", checkpoint_path);
+    int fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if (fd >= 0) close(fd);
+        return 0; // another controller started from this checkpoint is still running
+    }
+    // fd stays open, the lock goes with this process
+    char host[SHARD_OWNER_SIZE - 16] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    const char *colon = strrchr(owner, ':');
+    if (!colon || (size_t)(colon - owner) != strlen(host) || strncmp(owner, host, colon - owner) != 0) return 0;
+    char *end;
+    long pid = strtol(colon + 1, &end, 10);
+    if (*end || pid <= 0 || pid == (long)getpid()) return 0;
+    return kill((pid_t)pid, 0) != 0 && errno == ESRCH;
+}
+
+void *checkpoint_thread(void *arg) {
+    log_thread_name("checkpoint");
+    while (1) {
+        msleep(CHECKPOINT_INTERVAL_MS);
+        if (atomic_load(&lease_held)) checkpoint_write(checkpoint_path, &state); // a standby's state isn't authoritative
+    }
+    return NULL;
+}
+
+// Re-applies commands of this shard applied after last_apply_seq, by an earlier run after its
+// last checkpoint or by another owner while this process was standing by. Priorities apply
+// commands out of id order, so apply_seq gives the order they were applied in.
+void catch_up_commands(PGconn *conn, MotorState *s) {
+    pthread_mutex_lock(&last_processed_lock);
+    char q[256];
+    snprintf(q, sizeof(q),
+        "SELECT id, percent_change, apply_seq FROM commands WHERE shard_id = %d AND status = 'applied' AND apply_seq > %lld "
+        "ORDER BY apply_seq ASC", shard_id, last_apply_seq);
+    PGresult *res = PQexec(conn, q);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_error("Catch-up select failed: %s\n", PQerrorMessage(conn));
+    } else {
+        int rows = PQntuples(res);
+        for (int i = 0; i < rows; i++) {
+            motor_state_apply_percent(s, atof(PQgetvalue(res, i, 1)));
+            last_processed_id = atoll(PQgetvalue(res, i, 0));
+            last_apply_seq = atoll(PQgetvalue(res, i, 2));
+        }
+        if (rows > 0) log_info("[lease] caught up %d command(s) applied since the last checkpoint\n", rows);
+    }
+    PQclear(res);
+    pthread_mutex_unlock(&last_processed_lock);
+}
+
+// Continues the shard's apply order after the highest apply_seq any owner has used
+void seed_apply_seq(PGconn *conn) {
+    char q[128];
+    snprintf(q, sizeof(q), "SELECT COALESCE(MAX(apply_seq), 0) FROM commands WHERE shard_id = %d", shard_id);
+    PGresult *res = PQexec(conn, q);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        atomic_store(&next_apply_seq, atoll(PQgetvalue(res, 0, 0)));
+    } else {
+        log_error("Apply order select failed: %s\n", PQerrorMessage(conn));
+    }
+    PQclear(res);
+}
+
+void *lease_thread(void *arg) {
+    log_thread_name("lease");
+    PGconn *conn = thread_db_connect();
+    if (!conn) return NULL;
+    if (!init_db(conn)) return NULL;
+
+    int have_baseline = checkpoint_restored; // set point known to match last_apply_seq
+    while (1) {
+        long long epoch = lease_renew(conn);
+        int held = atomic_load(&lease_held);
+        if (epoch && !held) {
+            log_info("[lease] %s owns shard %d (epoch %lld)\n", shard_owner, shard_id, epoch);
+            if (have_baseline) catch_up_commands(conn, &state);
+            else resume_shard_set_point(conn, &state);
+            have_baseline = 1;
+            seed_apply_seq(conn);
+            atomic_store(&lease_held, 1);
+        } else if (!epoch && held) {
+            log_info("[lease] %s lost shard %d, standing by\n", shard_owner, shard_id);
+            atomic_store(&lease_held, 0);
+            command_queue_clear(&command_queue); // the new owner schedules them from the table
+        }
+        // Any controller of the shard may have admitted commands, so the cap is re-read each heartbeat
+        seed_in_flight(conn);
+        msleep(LEASE_HEARTBEAT_MS);
+    }
+
+    PQfinish(conn);
+    return NULL;
+}
+
 void *command_poller_thread(void *arg) {
-    printf("[Poller] Attempting DB connection...\n");
+    log_thread_name("poller");
+    log_info("[Poller] Attempting DB connection...\n");
     PGconn *conn = thread_db_connect();
     if (!conn) {
-        fprintf(stderr, "[Poller] Failed to connect to DB. Exiting thread.\n");
+        log_error("[Poller] Failed to connect to DB. Exiting thread.\n");
         return NULL;
     }
-    printf("[Poller] DB connected.\n");
+    log_info("[Poller] DB connected.\n");
     
     if (!init_db(conn)) {
-        fprintf(stderr, "[Poller] Failed to initialize DB/Select DB. Exiting thread.\n");
+        log_error("[Poller] Failed to initialize DB/Select DB. Exiting thread.\n");
         return NULL;
     }
-    printf("[Poller] DB initialized. Starting poll loop.\n");
+    log_info("[Poller] DB initialized. Starting poll loop.\n");
 
+    long long last_reload_ms = 0;
     while (1) {
-        poll_and_process_commands(conn, &state);
-        msleep(COMMAND_POLL_INTERVAL_MS);
+        long long now = now_ms();
+        if (atomic_load(&lease_held) && now - last_reload_ms >= COMMAND_POLL_INTERVAL_MS) {
+            command_queue_reload(conn, &command_queue);
+            last_reload_ms = now;
+        }
+        long wait_ms = poll_and_process_commands(conn, &state);
+        if (wait_ms > COMMAND_POLL_INTERVAL_MS) wait_ms = COMMAND_POLL_INTERVAL_MS;
+        command_queue_wait(&command_queue, wait_ms); // a push from the ingress thread cuts this short
     }   
 
     PQfinish(conn);
     return NULL;
 }
 
-// TCP client handler 
-void handle_client_socket(int client_fd, PGconn *conn) {
+// Sends a whole line to a subscriber without blocking the caller.
+// Returns 0 if the subscriber is too slow or has gone away.
+int fanout_send(int fd, const char *line) {
+    size_t len = strlen(line);
+    ssize_t w = send(fd, line, len, MSG_DONTWAIT);
+    return w == (ssize_t)len;
+}
+
+// Registers a monitoring client: replays the buffered commands, then keeps the fd for live pushes
+void fanout_add_subscriber(int client_fd) {
+    pthread_mutex_lock(&fanout.lock);
+    if (fanout.num_subscribers >= MAX_SUBSCRIBERS) {
+        pthread_mutex_unlock(&fanout.lock);
+        const char *fullmessage = "Subscribe failed: too many subscribers\n";
+        write(client_fd, fullmessage, strlen(fullmessage));
+        close(client_fd);
+        return;
+    }
+
+    // Replay under the lock so no command is missed or duplicated between replay and live stream
+    int start = (fanout.head - fanout.count + FANOUT_REPLAY_SIZE) % FANOUT_REPLAY_SIZE;
+    for (int i = 0; i < fanout.count; i++) {
+        if (!fanout_send(client_fd, fanout.lines[(start + i) % FANOUT_REPLAY_SIZE])) {
+            pthread_mutex_unlock(&fanout.lock);
+            close(client_fd);
+            return;
+        }
+    }
+    fanout.subscribers[fanout.num_subscribers++] = client_fd;
+    pthread_mutex_unlock(&fanout.lock);
+}
+
+// Appends a command to the replay ring and pushes it to every subscriber, dropping dead ones
+void fanout_publish(const char *line) {
+    pthread_mutex_lock(&fanout.lock);
+    snprintf(fanout.lines[fanout.head], FANOUT_LINE_SIZE, "%s", line);
+    fanout.head = (fanout.head + 1) % FANOUT_REPLAY_SIZE;
+    if (fanout.count < FANOUT_REPLAY_SIZE) fanout.count++;
+
+    int i = 0;
+    while (i < fanout.num_subscribers) {
+        if (fanout_send(fanout.subscribers[i], line)) { i++; continue; }
+        close(fanout.subscribers[i]);
+        fanout.subscribers[i] = fanout.subscribers[--fanout.num_subscribers];
+    }
+    pthread_mutex_unlock(&fanout.lock);
+}
+
+// Reads new rows from the commands table and fans them out.
+// One query per interval no matter how many clients are monitoring.
+void poll_and_fanout_commands(PGconn *conn, long long *last_id) {
+    char q[256];
+    if (*last_id < 0) {
+        // First pass: seed the replay buffer with the most recent commands only
+        snprintf(q, sizeof(q),
+            "SELECT id, client_id, percent_change, ts FROM commands "
+            "WHERE id > (SELECT COALESCE(MAX(id), 0) - %d FROM commands) ORDER BY id ASC",
+            FANOUT_REPLAY_SIZE);
+    } else {
+        snprintf(q, sizeof(q),
+            "SELECT id, client_id, percent_change, ts FROM commands WHERE id > %lld ORDER BY id ASC",
+            *last_id);
+    }
+
+    PGresult *res = PQexec(conn, q);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_error("Fan-out select failed: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        return;
+    }
+    if (*last_id < 0) *last_id = 0;
+
+    int rows = PQntuples(res);
+    for (int i = 0; i < rows; i++) {
+        long long id = atoll(PQgetvalue(res, i, 0));
+        char line[FANOUT_LINE_SIZE];
+        snprintf(line, sizeof(line), "id=%lld from=%s percent=%s ts=%s\n",
+            id, PQgetvalue(res, i, 1), PQgetvalue(res, i, 2), PQgetvalue(res, i, 3));
+        fanout_publish(line);
+        if (id > *last_id) *last_id = id;
+    }
+    PQclear(res);
+}
+
+// Command fan-out thread
+void *command_fanout_thread(void *arg) {
+    log_thread_name("fanout");
+    PGconn *conn = thread_db_connect();
+    if (!conn) return NULL;
+    if (!init_db(conn)) return NULL;
+
+    long long last_id = -1;
+    while (1) {
+        poll_and_fanout_commands(conn, &last_id);
+        msleep(FANOUT_POLL_INTERVAL_MS);
+    }
+
+    PQfinish(conn);
+    return NULL;
+}
+
+// Where a connection came from, for admission control and the commands table.
+// TCP clients are known by their address. Unix socket clients are known by the uid the kernel
+// reports for them (SO_PEERCRED), which they can't fake.
+struct ClientOrigin {
+    char addr_key[48];   // per-address bucket: "ip:<addr>" or "uid:<uid>"
+    char id_scope[24];   // appended to the client id's bucket, so one user can't drain another's
+    char issued_via[40]; // fits commands.issued_via
+    char default_id[24]; // client id when the client sends none
+};
+
+void origin_from_inet(const struct sockaddr_in *peer, ClientOrigin *o) {
+    char ip[INET_ADDRSTRLEN] = "unknown";
+    inet_ntop(AF_INET, &peer->sin_addr, ip, sizeof(ip));
+    snprintf(o->addr_key, sizeof(o->addr_key), "ip:%s", ip);
+    o->id_scope[0] = '\0';
+    snprintf(o->issued_via, sizeof(o->issued_via), "tcp");
+    snprintf(o->default_id, sizeof(o->default_id), "tcp_client");
+}
+
+int origin_from_unix(int client_fd, ClientOrigin *o) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) { log_error("SO_PEERCRED: %s", strerror(errno)); return 0; }
+    snprintf(o->addr_key, sizeof(o->addr_key), "uid:%u", (unsigned)cred.uid);
+    snprintf(o->id_scope, sizeof(o->id_scope), "@uid%u", (unsigned)cred.uid);
+    snprintf(o->issued_via, sizeof(o->issued_via), "unix:uid=%u,pid=%d", (unsigned)cred.uid, (int)cred.pid);
+    snprintf(o->default_id, sizeof(o->default_id), "uid%u", (unsigned)cred.uid);
+    return 1;
+}
+
+// Client handler for both the TCP port and the Unix socket
+void handle_client_socket(int client_fd, PGconn *conn, const ClientOrigin *origin) {
+    long long now = now_ms();
+    const char *addr_key = origin->addr_key;
+    int addr_ok = admission_take(admission_lookup(addr_key, ADDRESS_BURST, now), ADDRESS_RATE_PER_SEC, ADDRESS_BURST, now);
+    if (!addr_ok && !admission_refill(admission_reserve(addr_key, now), RESERVED_RATE_PER_SEC, RESERVED_BURST, now)) {
+        admission_refuse(client_fd, addr_key, ADDRESS_BURST, now); // shed before even reading
+        return;
+    }
+
     char buf[256];
     ssize_t r = read(client_fd, buf, sizeof(buf)-1);  // Makes sure date from client isn't empty
     if (r <= 0) { close(client_fd); return; }
     buf[r] = 0;
 
+    if (!addr_ok && (strncmp(buf, "SUBSCRIBE", 9) == 0 || strncmp(buf, "STATS", 5) == 0)) {
+        admission_refuse(client_fd, addr_key, ADDRESS_BURST, now); // the reserve is for commands only
+        return;
+    }
+    // "SUBSCRIBE <client_id>" keeps the connection open for peer monitoring
+    if (strncmp(buf, "SUBSCRIBE", 9) == 0) {
+        fanout_add_subscriber(client_fd);
+        return;
+    }
+
+    // "STATS" returns the admission counters per client and address
+    if (strncmp(buf, "STATS", 5) == 0) {
+        admission_write_stats(client_fd);
+        close(client_fd);
+        return;
+    }
+
+    // "<client_id> <percent> [low|normal|high|critical] [ttl_ms]": priority defaults to normal,
+    // and a command not applied within ttl_ms is dropped as expired
     char client_id[128] = {0};
     double percent = 0.0;
-    if (sscanf(buf, "%127s %lf", client_id, &percent) >= 1) {
-        if (strlen(client_id) == 0) strncpy(client_id, "tcp_client", sizeof(client_id)-1);
-        insert_command(conn, client_id, percent, "tcp");
+    char priority_s[16] = "normal";
+    long long ttl_ms = 0;
+    int priority = -1;
+    if (sscanf(buf, "%127s %lf %15s %lld", client_id, &percent, priority_s, &ttl_ms) >= 1 &&
+        (priority = parse_priority(priority_s)) >= 0 && ttl_ms >= 0) {
+        if (strlen(client_id) == 0) strncpy(client_id, origin->default_id, sizeof(client_id)-1);
+        // High and critical commands may draw on the reserved buckets once the shared ones are empty
+        int urgent = priority >= PRIORITY_HIGH;
+        if (!addr_ok && !(urgent && admission_take(admission_reserve(addr_key, now), RESERVED_RATE_PER_SEC, RESERVED_BURST, now))) {
+            admission_refuse(client_fd, addr_key, ADDRESS_BURST, now);
+            return;
+        }
+        // Poller is behind: refuse instead of queueing. High priority commands have some room left.
+        int cap = command_in_flight_cap(priority);
+        char id_key[ADMISSION_KEY_SIZE];
+        snprintf(id_key, sizeof(id_key), "id:%s%s", client_id, origin->id_scope);
+        AdmissionEntry *by_id = admission_lookup(id_key, CLIENT_BURST, now);
+        if (atomic_load(&commands_in_flight) >= cap) {
+            by_id->busy++;
+            admission_lookup(addr_key, ADDRESS_BURST, now)->busy++; // the id lookup may have recycled the slot
+            reply_and_close(client_fd, "Busy: too many pending commands, try again later\n");
+            return;
+        }
+        if (!admission_take(by_id, CLIENT_RATE_PER_SEC, CLIENT_BURST, now) &&
+            !(urgent && admission_take(admission_reserve(id_key, now), RESERVED_RATE_PER_SEC, RESERVED_BURST, now))) {
+            admission_refuse(client_fd, id_key, CLIENT_BURST, now);
+            return;
+        }
+        long long expires_ms = ttl_ms ? now + ttl_ms : 0;
+        long long id = insert_command(conn, client_id, percent, origin->issued_via, priority, expires_ms);
+        if (!id) {
+            reply_and_close(client_fd, "Insert failed\n");
+            return;
+        }
+        atomic_fetch_add(&commands_in_flight, 1);
+        if (atomic_load(&lease_held)) { // a standby leaves it to the owner's reload
+            QueuedCommand queued = { .id = id, .priority = priority, .expires_ms = expires_ms, .queued_ms = now, .percent = percent };
+            snprintf(queued.client_id, sizeof(queued.client_id), "%s", client_id);
+            command_queue_push(&command_queue, &queued);
+        }
+        admission_lookup(id_key, CLIENT_BURST, now)->accepted++; // the lookups since may have recycled either slot
+        admission_lookup(addr_key, ADDRESS_BURST, now)->accepted++;
         const char *successmessage = "Parse successful\n";
         write(client_fd, successmessage, strlen(successmessage));
     } else {
@@ -338,62 +1538,205 @@ void handle_client_socket(int client_fd, PGconn *conn) {
     close(client_fd);
 }
 
+// Listens on the shard's Unix socket. SOCK_SEQPACKET keeps message boundaries, so every
+// request and reply is one read, the same text as over TCP. The socket lives in a directory only
+// this user can write (see local_socket.h). A socket file left by a crashed controller refuses
+// connections and is replaced; a live one, or no usable directory, leaves this controller on TCP
+// only. Never waits: the TCP accept loop starts right after. Returns -1 if this can't work.
+int unix_listen(void) {
+    struct sockaddr_un addr;
+    if (!local_socket_server_addr(shard_id, &addr)) {
+        log_warn("[unix] no private socket directory (set XDG_RUNTIME_DIR or create %s), TCP only\n", LOCAL_SOCKET_SYSTEM_DIR);
+        return -1;
+    }
+
+    int srv = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (srv < 0) { log_error("unix socket: %s", strerror(errno)); return -1; }
+    int rc = bind(srv, (struct sockaddr*)&addr, sizeof(addr));
+    if (rc < 0 && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+        if (live) {
+            log_warn("[unix] %s is served by another process, TCP only\n", addr.sun_path);
+            close(srv);
+            return -1;
+        }
+        unlink(addr.sun_path); // stale
+        rc = bind(srv, (struct sockaddr*)&addr, sizeof(addr));
+    }
+    if (rc < 0) { log_error("unix bind: %s", strerror(errno)); close(srv); return -1; }
+    chmod(addr.sun_path, 0666); // other users only reach it under /run/motor_controller, $XDG_RUNTIME_DIR is 0700; admission keys on their uid
+    if (listen(srv, LISTEN_BACKLOG) < 0) { log_error("unix listen: %s", strerror(errno)); close(srv); unlink(addr.sun_path); return -1; }
+    log_info("[unix] listening on %s\n", addr.sun_path);
+    return srv;
+}
+
 // TCP server thread 
 void *tcp_server_thread(void *arg) {
+    log_thread_name("ingress");
     PGconn *conn = thread_db_connect();
     if (!conn) return NULL;
     if (!init_db(conn)) return NULL;
+    seed_in_flight(conn); // commands left unprocessed by a previous run count against the cap
 
     int srv = socket(AF_INET, SOCK_STREAM, 0);
-    if (srv < 0) { perror("socket"); return NULL; }
-    printf("[tcp] socket created\n");
+    if (srv < 0) { log_error("socket: %s", strerror(errno)); return NULL; }
+    log_info("[tcp] socket created\n");
     int opt = 1;
     setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(TCP_PORT);
+    addr.sin_port = htons(TCP_PORT + shard_id); // one port per shard
 
-    if (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); close(srv); return NULL; }
-    printf("[tcp] bind succeeded\n");
+    // A standby on the same host finds the port taken until the active controller goes away
+    while (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (errno != EADDRINUSE) { log_error("bind: %s", strerror(errno)); close(srv); return NULL; }
+        msleep(LEASE_HEARTBEAT_MS);
+    }
+    log_info("[tcp] bind succeeded\n");
 
-    if (listen(srv, LISTEN_BACKLOG) < 0) { perror("listen"); close(srv); return NULL; }
-    printf("[tcp] listening on port %d\n", TCP_PORT);
+    if (listen(srv, LISTEN_BACKLOG) < 0) { log_error("listen: %s", strerror(errno)); close(srv); return NULL; }
+    log_info("[tcp] listening on port %d\n", TCP_PORT + shard_id);
 
+    int usrv = unix_listen(); // co-located clients skip the TCP stack, -1 leaves TCP only
+    struct pollfd fds[2] = { { .fd = srv, .events = POLLIN }, { .fd = usrv, .events = POLLIN } }; // poll ignores a negative fd
     while (1) {
-        int client = accept(srv, NULL, NULL);
-        if (client < 0) { perror("accept"); continue; }
-        handle_client_socket(client, conn);
+        if (poll(fds, 2, -1) < 0) { if (errno != EINTR) log_error("poll: %s", strerror(errno)); continue; }
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_in peer;
+            socklen_t peer_len = sizeof(peer);
+            int client = accept(srv, (struct sockaddr*)&peer, &peer_len);
+            if (client >= 0) {
+                ClientOrigin origin;
+                origin_from_inet(&peer, &origin);
+                handle_client_socket(client, conn, &origin);
+            } else log_error("accept: %s", strerror(errno));
+        }
+        if (fds[1].revents & POLLIN) {
+            int client = accept(usrv, NULL, NULL);
+            ClientOrigin origin;
+            if (client >= 0 && origin_from_unix(client, &origin)) handle_client_socket(client, conn, &origin);
+            else if (client >= 0) close(client); // no credentials, no command
+            else log_error("unix accept: %s", strerror(errno));
+        }
     }
 
     close(srv);
+    if (usrv >= 0) close(usrv);
 
     PQfinish(conn);
     return NULL;
 }
 
+// Parses "--control-hz N", "--integrator euler|rk4" and "--seed N"
+int checkpoint_path_given = 0;
+int log_json_lines = 0;
+
+int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--control-hz") == 0 && i + 1 < argc) {
+            control_hz = atoi(argv[++i]);
+            if (control_hz < 1) control_hz = 1;
+        } else if (strcmp(argv[i], "--integrator") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            if (strcmp(name, "euler") == 0) integrator = INTEGRATOR_EULER;
+            else if (strcmp(name, "rk4") == 0) integrator = INTEGRATOR_RK4;
+            else { fprintf(stderr, "unknown integrator: %s\n", name); return 0; }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            control_seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+            shard_id = atoi(argv[++i]);
+            if (shard_id < 0) shard_id = 0;
+        } else if (strcmp(argv[i], "--owner") == 0 && i + 1 < argc) {
+            snprintf(shard_owner, sizeof(shard_owner), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--realtime") == 0) {
+            realtime.enabled = 1;
+        } else if (strcmp(argv[i], "--rt-priority") == 0 && i + 1 < argc) {
+            realtime.priority = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rt-cpu") == 0 && i + 1 < argc) {
+            realtime.cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            LogLevel level;
+            if (!log_parse_level(argv[++i], &level)) { fprintf(stderr, "unknown log level: %s\n", argv[i]); return 0; }
+            log_set_level(level);
+        } else if (strcmp(argv[i], "--log-json") == 0) {
+            log_json_lines = 1;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            const char *path = argv[++i];
+            snprintf(checkpoint_path, sizeof(checkpoint_path), "%s", strcmp(path, "none") == 0 ? "" : path);
+            checkpoint_path_given = 1;
+        } else {
+            fprintf(stderr, "usage: %s [--control-hz N] [--integrator euler|rk4] [--seed N] [--shard N] [--owner name] [--checkpoint path|none] [--realtime] [--rt-priority N] [--rt-cpu N] [--log-level debug|info|warn|error] [--log-json]\n", argv[0]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 // main
-int main() {
+int main(int argc, char **argv) {
 
-    srand(time(NULL));
-    pthread_mutex_init(&state.lock, NULL);
+    control_seed = (uint64_t)time(NULL);
+    if (!parse_args(argc, argv)) return 1;
+    log_thread_name("main");
+    if (realtime.enabled) { // before any thread exists, the log flusher included, so they all inherit the locked memory and the affinity
+        rt_setup_process(&realtime);
+    }
+    log_start(log_json_lines); // from here on no thread writes to stdout or stderr itself
+    if (!checkpoint_path_given) snprintf(checkpoint_path, sizeof(checkpoint_path), "motor_controller_shard%d.ckpt", shard_id);
+    signal(SIGPIPE, SIG_IGN); // a vanished subscriber must not kill the controller
 
     // Initialize state variables
-    state.gas_level = 100.0;
-    state.battery_level = 100.0;
-    state.motor_speed = 0.0;
-    state.motor_speed_set_point = 100.0;
-    state.motor_temp = 40.0;
+    state.live.gas_level = 100.0;
+    state.live.battery_level = 100.0;
+    state.live.motor_speed = 0.0;
+    state.live.motor_speed_set_point = 100.0;
+    state.live.motor_temp = 40.0;
+    state.pid = (PID){ .kp = 0.5, .ki = 0.1, .kd = 0.05, .prev_err = 0, .integral = 0 };
+    atomic_init(&state.seq, 0);
+    atomic_init(&state.set_point_mailbox, state.live.motor_speed_set_point);
+
+    ControllerCheckpoint ckpt;
+    if (checkpoint_path[0] && checkpoint_load(checkpoint_path, &ckpt)) {
+        checkpoint_restore(&ckpt, &state);
+        // Renewing our own lease under the same owner resumes at once instead of waiting out the TTL
+        if (!shard_owner[0] && checkpoint_owner_reusable(ckpt.owner)) snprintf(shard_owner, sizeof(shard_owner), "%s", ckpt.owner);
+    }
+    if (!shard_owner[0]) {
+        char host[SHARD_OWNER_SIZE - 16] = "localhost";
+        gethostname(host, sizeof(host) - 1);
+        snprintf(shard_owner, sizeof(shard_owner), "%s:%d", host, (int)getpid());
+    }
+    motor_state_publish(&state);
+    log_info("[controller] control loop at %d Hz (%s), telemetry every %d ms\n",
+        control_hz, integrator == INTEGRATOR_RK4 ? "rk4" : "euler", TELEMETRY_INTERVAL_MS);
+    log_info("[controller] shard %d as %s\n", shard_id, shard_owner);
+    if (realtime.enabled) {
+        if (realtime.cpu >= 0) log_info("[controller] realtime: SCHED_FIFO %d on cpu %d\n", realtime.priority, realtime.cpu);
+        else log_info("[controller] realtime: SCHED_FIFO %d, single cpu, not pinned\n", realtime.priority);
+    }
 
-    pthread_t t1, t2, t3;
+    pthread_t t0, t1, t2, t3, t4, t5, t6, t7;
+    pthread_create(&t0, NULL, control_thread, NULL);
     pthread_create(&t1, NULL, telemetry_thread, NULL);
     pthread_create(&t2, NULL, command_poller_thread, NULL);
     pthread_create(&t3, NULL, tcp_server_thread, NULL);
+    pthread_create(&t4, NULL, command_fanout_thread, NULL);
+    pthread_create(&t5, NULL, lease_thread, NULL);
+    if (checkpoint_path[0]) pthread_create(&t6, NULL, checkpoint_thread, NULL);
+    pthread_create(&t7, NULL, rt_log_thread, NULL); // thread for control loop jitter and overrun reports
 
+    pthread_join(t0, NULL);
     pthread_join(t1, NULL);
     pthread_join(t2, NULL);
     pthread_join(t3, NULL);
+    pthread_join(t4, NULL);
+    pthread_join(t5, NULL);
+    if (checkpoint_path[0]) pthread_join(t6, NULL);
+    pthread_join(t7, NULL);
 
     return 0;
 }
\ No newline at end of file
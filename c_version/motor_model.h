@@ -0,0 +1,112 @@
+/* motor_model.h
+   Motor plant and PID controller shared by the motor controllers and the offline tools.
+   Header only, so every executable still builds from a single gcc line.
+*/
+
+#ifndef MOTOR_MODEL_H
+#define MOTOR_MODEL_H
+
+#include <stdint.h>
+#include <math.h>
+
+#define MOTOR_CONTROL_SCALE 0.1 //control output to speed change, "a realistic scale factor"
+#define MOTOR_NOISE_DT 0.2      //step the noise amplitude was tuned at, the original 200 ms loop
+#define SET_POINT_MAX 10000.0   //highest set point a command can ask for
+
+// Set point after a percent change command, clamped to [0, SET_POINT_MAX]
+static inline double motor_apply_percent(double set_point, double percent) {
+    double next = set_point + set_point * (percent / 100.0); //gets new percentage
+    if (next < 0) next = 0;                                  //min clamp
+    if (next > SET_POINT_MAX) next = SET_POINT_MAX;          //max clamp
+    return next;
+}
+
+//PID struct
+typedef struct {
+    double kp, ki, kd;
+    double prev_err;
+    double integral;
+} PID;
+
+static inline double pid_step(PID *pid, double setpoint, double measure, double dt) {
+    double err = setpoint - measure;                                        //error is the desired setpoint minus the current measurement
+    pid->integral += err * dt;                                              //accumulates the past errors over time
+    double derivative = dt > 0 ? (err - pid->prev_err) / dt : 0;            //gets derivative, if dt is 0 then makes it 0
+    pid->prev_err = err;                                                    //previous error now equals the current error
+    return pid->kp * err + pid->ki * pid->integral + pid->kd * derivative;  //returns the summation of the P, I, and D. This value will be applied to the current motor speed to simulate. Can be positive or negative.
+}
+
+typedef enum { INTEGRATOR_EULER, INTEGRATOR_RK4 } Integrator;
+
+// Seedable PRNG (splitmix64 seeding, xorshift64* steps) so runs can be reproduced
+// and threads never share rand()'s hidden state
+static inline uint64_t motor_rng_seed(uint64_t seed) {
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+static inline uint32_t motor_rand(uint64_t *rng) {
+    uint64_t x = *rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *rng = x;
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+// Random error on the speed derivative, [-0.5, 0.5)
+static inline double motor_noise(uint64_t *rng) {
+    return ((int)(motor_rand(rng) % 100) - 50) / 100.0;
+}
+
+// Temperature follows speed plus some random error
+static inline double motor_temp(double speed, uint64_t *rng) {
+    return 20.0 + speed * 0.01 + ((motor_rand(rng) % 100) / 100.0 - 0.5);
+}
+
+// Closed loop derivatives of (speed, integral). The D term is held over the step
+// so RK4 doesn't need the derivative of its own output.
+static inline void motor_derivs(const PID *pid, double setpoint, double d_term, double noise,
+                                double speed, double integral, double *d_speed, double *d_integral) {
+    double err = setpoint - speed;
+    double control = pid->kp * err + pid->ki * integral + d_term;
+    *d_speed = control * MOTOR_CONTROL_SCALE + noise;
+    *d_integral = err;
+}
+
+// Noise is drawn fresh every step, so it averages out over the steps in a second: scaled by dt
+// alone it would all but vanish at 1 kHz. Scaling by sqrt(MOTOR_NOISE_DT / dt) keeps the random
+// walk it adds per second the same at any rate, and leaves the 200 ms loop exactly as it was.
+static inline double motor_noise_scale(double dt) {
+    return dt > 0 ? sqrt(MOTOR_NOISE_DT / dt) : 0;
+}
+
+// Advances motor speed by dt and returns the new speed.
+// Euler is the original controller update; RK4 integrates speed and the PID integral together.
+static inline double motor_step(PID *pid, Integrator integrator, double setpoint, double speed, double noise, double dt) {
+    double next;
+    noise *= motor_noise_scale(dt);
+    if (integrator == INTEGRATOR_RK4) {
+        double err = setpoint - speed;
+        double d_term = dt > 0 ? pid->kd * (err - pid->prev_err) / dt : 0;
+        double i = pid->integral;
+        double k1s, k1i, k2s, k2i, k3s, k3i, k4s, k4i;
+        motor_derivs(pid, setpoint, d_term, noise, speed, i, &k1s, &k1i);
+        motor_derivs(pid, setpoint, d_term, noise, speed + 0.5 * dt * k1s, i + 0.5 * dt * k1i, &k2s, &k2i);
+        motor_derivs(pid, setpoint, d_term, noise, speed + 0.5 * dt * k2s, i + 0.5 * dt * k2i, &k3s, &k3i);
+        motor_derivs(pid, setpoint, d_term, noise, speed + dt * k3s, i + dt * k3i, &k4s, &k4i);
+        pid->integral = i + dt / 6.0 * (k1i + 2 * k2i + 2 * k3i + k4i);
+        pid->prev_err = err;
+        next = speed + dt / 6.0 * (k1s + 2 * k2s + 2 * k3s + k4s);
+    } else {
+        double control = pid_step(pid, setpoint, speed, dt);
+        next = speed + (control * MOTOR_CONTROL_SCALE + noise) * dt;
+    }
+    if (next < 0) next = 0; //speed can't be less than 0
+    return next;
+}
+
+#endif
@@ -0,0 +1,272 @@
+/* pid_tuner.c
+   Headless PID gain sweep. Simulates the controller's motor model in simulated time for every
+   (kp, ki, kd) candidate on a grid, in parallel across all cores, scores each run and prints
+   the Pareto front of overshoot, settling time and ITAE as CSV.
+   Compile:
+     gcc -O2 pid_tuner.c -o pid_tuner -lpthread -lm
+   Usage:
+     ./pid_tuner [--kp min:max:n] [--ki min:max:n] [--kd min:max:n] [--commands file]
+                 [--hold seconds] [--hz N] [--integrator euler|rk4] [--threads N] [--seed N]
+   The commands file holds one "<ms offset> <percent change>" per line ('#' starts a comment),
+   the same shape as the commands table. Without it a synthetic step sequence is used.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdatomic.h>
+#include "motor_model.h"
+
+#define MAX_COMMANDS 4096
+#define SETTLE_BAND 0.02        // settled once within 2% of the step size
+#define INITIAL_SET_POINT 100.0 // matches the controller's startup set point
+
+typedef struct {
+    long long t_ms;
+    double percent;
+} SweepCommand;
+
+typedef struct {
+    double min, max;
+    int steps;
+} GainRange;
+
+typedef struct {
+    double kp, ki, kd;
+    double overshoot_pct; // worst overshoot over all set point steps
+    double settling_s;    // mean settling time per step
+    double itae;          // sum over steps of integral of t * |e| dt, t measured from each step
+    int on_front;
+} Candidate;
+
+SweepCommand commands[MAX_COMMANDS];
+int num_commands = 0;
+long long duration_ms = 0;
+
+int sim_hz = 100;
+Integrator integrator = INTEGRATOR_EULER;
+uint64_t seed = 1;
+
+Candidate *candidates = NULL;
+int num_candidates = 0;
+atomic_int next_candidate;
+
+long long mono_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000LL;
+}
+
+double gain_at(const GainRange *r, int i) {
+    if (r->steps <= 1) return r->min;
+    return r->min + (r->max - r->min) * i / (r->steps - 1);
+}
+
+// Parses "min:max:n" (or a single fixed value)
+int parse_range(const char *s, GainRange *r) {
+    if (sscanf(s, "%lf:%lf:%d", &r->min, &r->max, &r->steps) == 3 && r->steps >= 1) return 1;
+    if (sscanf(s, "%lf", &r->min) == 1) { r->max = r->min; r->steps = 1; return 1; }
+    return 0;
+}
+
+// Reads "<ms offset> <percent>" lines, sorted by time
+int load_commands(const char *path, long long hold_ms) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return 0; }
+    char line[256];
+    while (fgets(line, sizeof(line), f) && num_commands < MAX_COMMANDS) {
+        if (line[0] == '#') continue;
+        SweepCommand c;
+        if (sscanf(line, "%lld %lf", &c.t_ms, &c.percent) == 2) commands[num_commands++] = c;
+    }
+    fclose(f);
+    if (num_commands == 0) { fprintf(stderr, "%s: no commands\n", path); return 0; }
+    for (int i = 1; i < num_commands; i++) {
+        if (commands[i].t_ms < commands[i - 1].t_ms) { fprintf(stderr, "%s: commands must be in time order\n", path); return 0; }
+    }
+    duration_ms = commands[num_commands - 1].t_ms + hold_ms;
+    return 1;
+}
+
+// Synthetic up/down steps, each held long enough for the stock gains to settle
+void synthetic_commands(long long hold_ms) {
+    const double steps[] = { 25.0, -20.0, 50.0, -30.0 };
+    num_commands = 0;
+    for (int i = 0; i < 4; i++) {
+        commands[num_commands].t_ms = i * hold_ms;
+        commands[num_commands].percent = steps[i];
+        num_commands++;
+    }
+    duration_ms = num_commands * hold_ms;
+}
+
+// Runs one candidate through the whole command sequence in simulated time
+void simulate(Candidate *c) {
+    PID pid = { .kp = c->kp, .ki = c->ki, .kd = c->kd, .prev_err = 0, .integral = 0 };
+    uint64_t rng = motor_rng_seed(seed); // same noise for every candidate so scores are comparable
+    double dt = 1.0 / sim_hz;
+    long long ticks = duration_ms * sim_hz / 1000;
+
+    // Start settled at the initial set point so the first score is the first command's step
+    double set_point = INITIAL_SET_POINT;
+    double speed = INITIAL_SET_POINT;
+    int next_cmd = 0;
+
+    double step_from = set_point, step_size = 0, step_t = 0;
+    double peak = 0, last_outside = 0;
+    int steps_scored = 0;
+    double overshoot = 0, settling_sum = 0, itae = 0;
+
+    for (long long k = 0; k <= ticks; k++) {
+        double t = k * dt;
+        while (next_cmd < num_commands && commands[next_cmd].t_ms <= t * 1000.0) {
+            if (step_size != 0) { // close the previous step
+                overshoot = fmax(overshoot, peak);
+                settling_sum += last_outside;
+                steps_scored++;
+            }
+            step_from = set_point;
+            set_point = motor_apply_percent(set_point, commands[next_cmd].percent);
+            step_size = set_point - step_from;
+            step_t = t;
+            peak = 0;
+            last_outside = 0;
+            next_cmd++;
+        }
+
+        speed = motor_step(&pid, integrator, set_point, speed, motor_noise(&rng), dt);
+        if (!isfinite(speed)) { // unstable gains
+            c->overshoot_pct = c->settling_s = c->itae = INFINITY;
+            return;
+        }
+
+        if (step_size != 0) {
+            double err = set_point - speed;
+            double since = t - step_t;
+            itae += since * fabs(err) * dt;
+            double past = (speed - set_point) / step_size * 100.0; // % beyond the target, in the step's direction
+            if (past > peak) peak = past;
+            if (fabs(err) > SETTLE_BAND * fabs(step_size)) last_outside = since;
+        }
+    }
+    if (step_size != 0) {
+        overshoot = fmax(overshoot, peak);
+        settling_sum += last_outside;
+        steps_scored++;
+    }
+
+    c->overshoot_pct = overshoot;
+    c->settling_s = steps_scored ? settling_sum / steps_scored : 0;
+    c->itae = itae;
+}
+
+void *sweep_worker(void *arg) {
+    int i;
+    while ((i = atomic_fetch_add(&next_candidate, 1)) < num_candidates) {
+        simulate(&candidates[i]);
+    }
+    return NULL;
+}
+
+// a dominates b if it is no worse on every objective and better on at least one
+int dominates(const Candidate *a, const Candidate *b) {
+    if (a->overshoot_pct > b->overshoot_pct || a->settling_s > b->settling_s || a->itae > b->itae) return 0;
+    return a->overshoot_pct < b->overshoot_pct || a->settling_s < b->settling_s || a->itae < b->itae;
+}
+
+int by_itae(const void *a, const void *b) {
+    double x = ((const Candidate *)a)->itae, y = ((const Candidate *)b)->itae;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    GainRange kp = { 0.1, 2.0, 20 }, ki = { 0.0, 0.5, 20 }, kd = { 0.0, 0.2, 10 };
+    const char *commands_path = NULL;
+    long long hold_ms = 200000;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        int ok = v != NULL;
+        if (ok && strcmp(a, "--kp") == 0) ok = parse_range(v, &kp);
+        else if (ok && strcmp(a, "--ki") == 0) ok = parse_range(v, &ki);
+        else if (ok && strcmp(a, "--kd") == 0) ok = parse_range(v, &kd);
+        else if (ok && strcmp(a, "--commands") == 0) commands_path = v;
+        else if (ok && strcmp(a, "--hold") == 0) hold_ms = (long long)(atof(v) * 1000);
+        else if (ok && strcmp(a, "--hz") == 0) sim_hz = atoi(v);
+        else if (ok && strcmp(a, "--threads") == 0) threads = atoi(v);
+        else if (ok && strcmp(a, "--seed") == 0) seed = strtoull(v, NULL, 10);
+        else if (ok && strcmp(a, "--integrator") == 0) {
+            if (strcmp(v, "euler") == 0) integrator = INTEGRATOR_EULER;
+            else if (strcmp(v, "rk4") == 0) integrator = INTEGRATOR_RK4;
+            else ok = 0;
+        } else ok = 0;
+        if (!ok) {
+            fprintf(stderr, "usage: %s [--kp min:max:n] [--ki min:max:n] [--kd min:max:n] [--commands file]\n"
+                            "          [--hold seconds] [--hz N] [--integrator euler|rk4] [--threads N] [--seed N]\n", argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if (sim_hz < 1) sim_hz = 1;
+    if (threads < 1) threads = 1;
+    if (hold_ms < 1) hold_ms = 1;
+
+    if (commands_path) {
+        if (!load_commands(commands_path, hold_ms)) return 1;
+    } else {
+        synthetic_commands(hold_ms);
+    }
+
+    num_candidates = kp.steps * ki.steps * kd.steps;
+    candidates = calloc(num_candidates, sizeof(Candidate));
+    if (!candidates) { fprintf(stderr, "out of memory\n"); return 1; }
+    int n = 0;
+    for (int a = 0; a < kp.steps; a++)
+        for (int b = 0; b < ki.steps; b++)
+            for (int c = 0; c < kd.steps; c++) {
+                candidates[n].kp = gain_at(&kp, a);
+                candidates[n].ki = gain_at(&ki, b);
+                candidates[n].kd = gain_at(&kd, c);
+                n++;
+            }
+
+    fprintf(stderr, "[tuner] %d candidates, %d commands, %.0f s simulated each at %d Hz on %d threads\n",
+        num_candidates, num_commands, duration_ms / 1000.0, sim_hz, threads);
+    long long start = mono_ms();
+
+    atomic_init(&next_candidate, 0);
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    for (int t = 0; t < threads; t++) pthread_create(&workers[t], NULL, sweep_worker, NULL);
+    for (int t = 0; t < threads; t++) pthread_join(workers[t], NULL);
+    free(workers);
+
+    long long elapsed = mono_ms() - start;
+
+    int front = 0;
+    for (int i = 0; i < num_candidates; i++) {
+        Candidate *c = &candidates[i];
+        c->on_front = isfinite(c->itae);
+        for (int j = 0; j < num_candidates && c->on_front; j++) {
+            if (j != i && dominates(&candidates[j], c)) c->on_front = 0;
+        }
+        front += c->on_front;
+    }
+    qsort(candidates, num_candidates, sizeof(Candidate), by_itae);
+
+    fprintf(stderr, "[tuner] swept in %lld ms, %d candidates on the Pareto front\n", elapsed, front);
+    printf("kp,ki,kd,overshoot_pct,settling_s,itae\n");
+    for (int i = 0; i < num_candidates; i++) {
+        Candidate *c = &candidates[i];
+        if (c->on_front) printf("%.4f,%.4f,%.4f,%.3f,%.3f,%.1f\n", c->kp, c->ki, c->kd, c->overshoot_pct, c->settling_s, c->itae);
+    }
+
+    free(candidates);
+    return 0;
+}
@@ -0,0 +1,219 @@
+/* realtime.h
+   Opt-in real-time execution for the control loop, shared by the motor controllers and
+   jitter_report. Header only, like motor_model.h. Includers define _GNU_SOURCE before their
+   first #include, for the CPU affinity calls.
+
+   rt_setup_process runs in main before any thread is created. It locks all current and future
+   pages with mlockall. It also takes the control core out of main's affinity mask, so every
+   thread created afterwards inherits a mask without it. rt_enter_thread then runs on the control
+   thread: it pins itself to that core, switches to SCHED_FIFO and pre-faults its stack. From
+   then on the tick must not call printf or malloc. It reports through an RtLogRing, a
+   single-producer single-consumer ring that another thread drains. Both setup calls report
+   problems with log_warn (async_log.h), so main should start the log flusher only after
+   rt_setup_process: the flusher then inherits the mask too and never runs on the control core.
+
+   For the best numbers, boot with the control core isolated, e.g. for core 3:
+     isolcpus=3 nohz_full=3 rcu_nocbs=3
+   With no --rt-cpu, the first isolated core is used, or else the last online one.
+*/
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include "async_log.h"
+
+#define RT_PRIORITY_DEFAULT 80
+#define RT_PREFAULT_STACK_BYTES (256 * 1024)
+#define RT_LOG_RING_SIZE 256    // power of two
+#define RT_JITTER_BUCKETS 1024  // 1 us each, the last one also holds everything later
+
+typedef struct {
+    int enabled;
+    int priority; // SCHED_FIFO, 1..99
+    int cpu;      // core for the control thread, -1 picks one
+} RealtimeConfig;
+
+// Wake-up lateness of a periodic loop, without allocation
+typedef struct {
+    long long count;
+    long long overruns; // ticks that started more than a period late
+    long long max_ns;
+    long long sum_ns;
+    long long buckets[RT_JITTER_BUCKETS];
+} JitterStats;
+
+enum { RT_LOG_OVERRUN, RT_LOG_JITTER };
+
+typedef struct {
+    int kind;
+    long long t_ns;
+    long long v[6]; // RT_LOG_OVERRUN: late ns | RT_LOG_JITTER: ticks, p50, p99, p99.9, max (us), overruns
+} RtLogRecord;
+
+typedef struct {
+    RtLogRecord slots[RT_LOG_RING_SIZE];
+    atomic_uint head;    // next slot the producer writes
+    atomic_uint tail;    // next slot the consumer reads
+    atomic_uint dropped; // records lost to a full ring
+} RtLogRing;
+
+static inline void jitter_reset(JitterStats *j) {
+    memset(j, 0, sizeof(*j));
+}
+
+static inline void jitter_add(JitterStats *j, long long late_ns) {
+    if (late_ns < 0) late_ns = 0;
+    long long us = late_ns / 1000;
+    j->buckets[us < RT_JITTER_BUCKETS ? us : RT_JITTER_BUCKETS - 1]++;
+    j->count++;
+    j->sum_ns += late_ns;
+    if (late_ns > j->max_ns) j->max_ns = late_ns;
+}
+
+// Upper edge in us of the bucket holding quantile q; the last bucket reports the exact max
+static inline long long jitter_percentile_us(const JitterStats *j, double q) {
+    if (j->count == 0) return 0;
+    long long rank = (long long)(q * j->count), seen = 0;
+    for (int b = 0; b < RT_JITTER_BUCKETS - 1; b++) {
+        seen += j->buckets[b];
+        if (seen > rank) return b + 1;
+    }
+    return j->max_ns / 1000;
+}
+
+// Producer side, never blocks: a full ring drops the record and counts it
+static inline int rt_log_push(RtLogRing *r, const RtLogRecord *rec) {
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail >= RT_LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return 0;
+    }
+    r->slots[head & (RT_LOG_RING_SIZE - 1)] = *rec;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return 1;
+}
+
+static inline int rt_log_pop(RtLogRing *r, RtLogRecord *out) {
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail == head) return 0;
+    *out = r->slots[tail & (RT_LOG_RING_SIZE - 1)];
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+// Summary of one reporting window, pushed by the loop itself
+static inline void rt_log_jitter(RtLogRing *r, long long t_ns, const JitterStats *j) {
+    RtLogRecord rec = { .kind = RT_LOG_JITTER, .t_ns = t_ns };
+    rec.v[0] = j->count;
+    rec.v[1] = jitter_percentile_us(j, 0.50);
+    rec.v[2] = jitter_percentile_us(j, 0.99);
+    rec.v[3] = jitter_percentile_us(j, 0.999);
+    rec.v[4] = j->max_ns / 1000;
+    rec.v[5] = j->overruns;
+    rt_log_push(r, &rec);
+}
+
+// Absolute CLOCK_MONOTONIC sleep: no drift and no window between reading the clock and sleeping
+static inline void rt_sleep_until_ns(long long deadline_ns) {
+    struct timespec ts = { deadline_ns / 1000000000LL, deadline_ns % 1000000000LL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
+}
+
+// 1 if the core is listed in isolcpus, 0 if not, -1 if the kernel doesn't say
+static inline int rt_cpu_isolated(int cpu, int *first_isolated) {
+    if (first_isolated) *first_isolated = -1;
+    FILE *f = fopen("/sys/devices/system/cpu/isolated", "r");
+    if (!f) return -1;
+    char list[256] = "";
+    if (!fgets(list, sizeof(list), f)) list[0] = '\0';
+    fclose(f);
+
+    int found = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(list, ",\n", &save); tok; tok = strtok_r(NULL, ",\n", &save)) {
+        int lo, hi;
+        int n = sscanf(tok, "%d-%d", &lo, &hi);
+        if (n < 1) continue;
+        if (n == 1) hi = lo;
+        if (first_isolated && *first_isolated < 0) *first_isolated = lo;
+        if (cpu >= lo && cpu <= hi) found = 1;
+    }
+    return found;
+}
+
+// Called from main before any thread starts. Picks the control core, locks memory and moves
+// everything else off that core. Problems are warnings: the loop still runs, just less
+// predictably. Returns 1 only if every step worked.
+static inline int rt_setup_process(RealtimeConfig *c) {
+    int ok = 1;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (c->priority < 1 || c->priority > 99) c->priority = RT_PRIORITY_DEFAULT;
+    if (c->cpu < 0) {
+        int first_isolated;
+        rt_cpu_isolated(0, &first_isolated);
+        c->cpu = first_isolated >= 0 ? first_isolated : (online > 1 ? (int)online - 1 : -1);
+    }
+    if (c->cpu >= 0 && rt_cpu_isolated(c->cpu, NULL) != 1) {
+        log_warn("[realtime] cpu %d is not isolated (isolcpus=), other tasks may still run on it\n", c->cpu);
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        log_warn("[realtime] mlockall failed: %s (raise RLIMIT_MEMLOCK or run with CAP_IPC_LOCK)\n", strerror(errno));
+        ok = 0;
+    }
+
+    if (c->cpu >= 0) {
+        cpu_set_t others;
+        if (sched_getaffinity(0, sizeof(others), &others) == 0) {
+            CPU_CLR(c->cpu, &others);
+            if (CPU_COUNT(&others) == 0 || sched_setaffinity(0, sizeof(others), &others) != 0) {
+                log_warn("[realtime] could not move the other threads off cpu %d\n", c->cpu);
+                ok = 0;
+            }
+        }
+    }
+    return ok;
+}
+
+// Touches the stack the loop will use so its first ticks don't take page faults
+static inline void rt_prefault_stack(void) {
+    volatile unsigned char stack[RT_PREFAULT_STACK_BYTES];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
+}
+
+// Called on the control thread itself, before its loop
+static inline int rt_enter_thread(const RealtimeConfig *c) {
+    int ok = 1;
+    if (c->cpu >= 0) {
+        cpu_set_t mine;
+        CPU_ZERO(&mine);
+        CPU_SET(c->cpu, &mine);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+        if (rc != 0) {
+            log_warn("[realtime] pinning to cpu %d failed: %s\n", c->cpu, strerror(rc));
+            ok = 0;
+        }
+    }
+    struct sched_param sp = { .sched_priority = c->priority };
+    int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if (rc != 0) {
+        log_warn("[realtime] SCHED_FIFO %d failed: %s (needs CAP_SYS_NICE or an rtprio limit)\n", c->priority, strerror(rc));
+        ok = 0;
+    }
+    rt_prefault_stack();
+    return ok;
+}
+
+#endif
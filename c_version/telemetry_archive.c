@@ -0,0 +1,237 @@
+/* telemetry_archive.c
+   Reads the compressed columnar telemetry archives written by the clients' --archive, without
+   touching the database.
+   Compile:
+     gcc -O2 telemetry_archive.c -o telemetry_archive -lm
+   Usage:
+     ./client_pgsql <client_id> --archive <from_epoch_s> <to_epoch_s> run.mta
+     ./telemetry_archive info run.mta
+     ./telemetry_archive cat run.mta [--from epoch_s] [--to epoch_s]
+     ./telemetry_archive scan run.mta <field> [--from epoch_s] [--to epoch_s] [--min x] [--max y]
+     ./telemetry_archive selftest
+   cat prints "<epoch ms> <gas> <battery> <speed> <set point> <temp>" rows. scan reports count,
+   min, max and mean of one field over the rows in the time range whose value lies in [min, max];
+   blocks whose index entry can't match are skipped without being decoded. selftest writes and
+   reads back an archive whose timestamps hit every edge of the delta-of-delta buckets, and
+   exits non-zero if any row doesn't come back bit exact.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include "telemetry_archive.h"
+
+const char *telemetry_fields[ARCHIVE_FIELDS] = {
+    "gas_level", "battery_level", "motor_speed", "motor_speed_set_point", "motor_temp"
+};
+
+long long mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int archive_info(const ArchiveReader *r, const char *path) {
+    long long rows = 0, col_bytes[ARCHIVE_COLUMNS] = { 0 };
+    for (int b = 0; b < r->blocks; b++) {
+        rows += r->index[b].rows;
+        for (int c = 0; c < ARCHIVE_COLUMNS; c++) col_bytes[c] += r->index[b].bytes[c];
+    }
+    // What the same rows cost uncompressed: an 8 byte timestamp plus five doubles
+    long long raw = rows * 8LL * ARCHIVE_COLUMNS;
+    printf("%s: %lld rows in %d blocks, %zu bytes (%.2f bytes/row, %.1fx smaller than raw %lld bytes)\n",
+        path, rows, r->blocks, r->size, rows ? (double)r->size / rows : 0.0,
+        r->size ? (double)raw / r->size : 0.0, raw);
+    if (r->fraction_bits < 0) printf("values: lossless\n");
+    else printf("values: rounded to 2^-%d (%.3g)\n", r->fraction_bits, ldexp(1.0, -r->fraction_bits));
+    if (r->blocks > 0) {
+        printf("time range: %lld .. %lld ms\n", (long long)r->index[0].t_first, (long long)r->index[r->blocks - 1].t_last);
+    }
+    printf("%-22s %10s %12s\n", "column", "bytes", "bits/value");
+    printf("%-22s %10lld %12.2f\n", "ts", col_bytes[0], rows ? col_bytes[0] * 8.0 / rows : 0.0);
+    for (int f = 0; f < ARCHIVE_FIELDS; f++) {
+        printf("%-22s %10lld %12.2f\n", telemetry_fields[f], col_bytes[1 + f], rows ? col_bytes[1 + f] * 8.0 / rows : 0.0);
+    }
+    return 0;
+}
+
+int archive_cat(const ArchiveReader *r, long long from_ms, long long to_ms) {
+    int64_t ts[ARCHIVE_BLOCK_ROWS];
+    double cols[ARCHIVE_FIELDS][ARCHIVE_BLOCK_ROWS];
+    printf("# epoch_ms gas_level battery_level motor_speed motor_speed_set_point motor_temp\n");
+    for (int b = 0; b < r->blocks; b++) {
+        const ArchiveBlockInfo *info = &r->index[b];
+        if (info->t_last < from_ms || info->t_first >= to_ms) continue;
+        uint32_t rows = archive_decode_column(r, b, 0, ts, NULL);
+        for (int f = 0; f < ARCHIVE_FIELDS; f++) archive_decode_column(r, b, 1 + f, NULL, cols[f]);
+        for (uint32_t i = 0; i < rows; i++) {
+            if (ts[i] < from_ms || ts[i] >= to_ms) continue;
+            printf("%lld %.17g %.17g %.17g %.17g %.17g\n", (long long)ts[i],
+                cols[0][i], cols[1][i], cols[2][i], cols[3][i], cols[4][i]);
+        }
+    }
+    return 0;
+}
+
+// Decodes only the field asked for, plus timestamps for blocks cut by the time range
+int archive_scan(const ArchiveReader *r, int field, long long from_ms, long long to_ms, double lo, double hi) {
+    int64_t ts[ARCHIVE_BLOCK_ROWS];
+    double values[ARCHIVE_BLOCK_ROWS];
+    long long count = 0;
+    double min = INFINITY, max = -INFINITY, sum = 0;
+    int decoded = 0, skipped = 0;
+
+    long long start = mono_ns();
+    for (int b = 0; b < r->blocks; b++) {
+        const ArchiveBlockInfo *info = &r->index[b];
+        if (info->t_last < from_ms || info->t_first >= to_ms || info->max[field] < lo || info->min[field] > hi) {
+            skipped++;
+            continue;
+        }
+        decoded++;
+        uint32_t rows = archive_decode_column(r, b, 1 + field, NULL, values);
+
+        // Block wholly inside the range: no timestamps needed and no per row tests at all
+        if (info->t_first >= from_ms && info->t_last < to_ms && info->min[field] >= lo && info->max[field] <= hi) {
+            for (uint32_t i = 0; i < rows; i++) sum += values[i];
+            count += rows;
+            if (info->min[field] < min) min = info->min[field];
+            if (info->max[field] > max) max = info->max[field];
+            continue;
+        }
+        archive_decode_column(r, b, 0, ts, NULL);
+        for (uint32_t i = 0; i < rows; i++) {
+            double v = values[i];
+            if (ts[i] < from_ms || ts[i] >= to_ms || v < lo || v > hi) continue;
+            count++;
+            sum += v;
+            if (v < min) min = v;
+            if (v > max) max = v;
+        }
+    }
+    long long elapsed_us = (mono_ns() - start) / 1000;
+
+    printf("%s: count=%lld", telemetry_fields[field], count);
+    if (count > 0) printf(" min=%.6f max=%.6f mean=%.6f", min, max, sum / count);
+    printf("\n");
+    fprintf(stderr, "[scan] %d blocks decoded, %d skipped by the index, %lld us\n", decoded, skipped, elapsed_us);
+    return 0;
+}
+
+// Round trip through a temporary file. The timestamp steps walk each bucket's smallest and
+// largest delta-of-delta and one past it, in both directions, then jump by more than any bucket.
+int archive_selftest(void) {
+    const int64_t edges[] = { 0, 1, -1, 63, 64, -64, -65, 255, 256, -256, -257, 2047, 2048, -2048, -2049,
+                              1LL << 40, -(1LL << 40) };
+    const int num_edges = (int)(sizeof(edges) / sizeof(edges[0]));
+    int rows = 3 * ARCHIVE_BLOCK_ROWS / 2; // the second block starts mid sequence
+    int64_t *ts = malloc(sizeof(int64_t) * rows);
+    double (*v)[ARCHIVE_FIELDS] = malloc(sizeof(*v) * rows);
+    int64_t *got_ts = malloc(sizeof(int64_t) * ARCHIVE_BLOCK_ROWS);
+    double *got_v = malloc(sizeof(double) * ARCHIVE_BLOCK_ROWS);
+    if (!ts || !v || !got_ts || !got_v) { fprintf(stderr, "out of memory\n"); return 1; }
+
+    int64_t delta = 200;
+    ts[0] = 1760000000000LL;
+    for (int i = 1; i < rows; i++) {
+        delta += edges[i % num_edges] * ((i / num_edges) % 2 ? -1 : 1); // undo the walk every other pass
+        ts[i] = ts[i - 1] + delta;
+    }
+    for (int i = 0; i < rows; i++) {
+        v[i][0] = 100.0 - i * 0.01;
+        v[i][1] = i % 7 ? v[i > 0 ? i - 1 : 0][1] : 50.0 + i; // repeats take the one bit path
+        v[i][2] = sin(i * 0.1) * 1500.0;
+        v[i][3] = i % 2 ? -0.0 : 1e-300;
+        v[i][4] = i % 3 ? INFINITY : 40.0 + i * 1e-9;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/telemetry_archive_selftest_%d.mta", (int)getpid());
+    ArchiveWriter w;
+    int ok = archive_writer_open(&w, path, -1);
+    for (int i = 0; ok && i < rows; i++) ok = archive_writer_append(&w, ts[i], v[i]);
+    if (ok) ok = archive_writer_close(&w);
+
+    ArchiveReader r;
+    if (ok) ok = archive_reader_open(&r, path);
+    remove(path);
+    int mismatches = 0, row = 0;
+    for (int b = 0; ok && b < r.blocks; b++) {
+        uint32_t n = archive_decode_column(&r, b, 0, got_ts, NULL);
+        for (uint32_t i = 0; i < n; i++) {
+            if (got_ts[i] != ts[row + i] && mismatches++ < 5) {
+                fprintf(stderr, "[selftest] row %d: ts %lld, expected %lld\n", row + (int)i, (long long)got_ts[i], (long long)ts[row + i]);
+            }
+        }
+        for (int f = 0; f < ARCHIVE_FIELDS; f++) {
+            archive_decode_column(&r, b, 1 + f, NULL, got_v);
+            for (uint32_t i = 0; i < n; i++) {
+                if (archive_double_bits(got_v[i]) != archive_double_bits(v[row + i][f]) && mismatches++ < 5) {
+                    fprintf(stderr, "[selftest] row %d: %s %.17g, expected %.17g\n", row + (int)i, telemetry_fields[f], got_v[i], v[row + i][f]);
+                }
+            }
+        }
+        row += n;
+    }
+    if (ok) archive_reader_close(&r);
+    free(ts); free(v); free(got_ts); free(got_v);
+
+    if (!ok || row != rows || mismatches) {
+        fprintf(stderr, "[selftest] FAILED: %d of %d rows read back, %d mismatches\n", row, rows, mismatches);
+        return 1;
+    }
+    printf("[selftest] %d rows round-tripped bit exact\n", rows);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *usage =
+        "usage: %s info <file>\n"
+        "       %s cat <file> [--from epoch_s] [--to epoch_s]\n"
+        "       %s scan <file> <field> [--from epoch_s] [--to epoch_s] [--min x] [--max y]\n"
+        "       %s selftest\n";
+    if (argc == 2 && strcmp(argv[1], "selftest") == 0) return archive_selftest();
+    if (argc < 3) { fprintf(stderr, usage, argv[0], argv[0], argv[0], argv[0]); return 1; }
+    const char *cmd = argv[1], *path = argv[2];
+
+    int field = -1, first_opt = 3;
+    if (strcmp(cmd, "scan") == 0) {
+        if (argc < 4) { fprintf(stderr, usage, argv[0], argv[0], argv[0], argv[0]); return 1; }
+        for (int f = 0; f < ARCHIVE_FIELDS; f++) {
+            if (strcmp(argv[3], telemetry_fields[f]) == 0) field = f;
+        }
+        if (field < 0) { fprintf(stderr, "unknown telemetry field: %s\n", argv[3]); return 1; }
+        first_opt = 4;
+    } else if (strcmp(cmd, "info") != 0 && strcmp(cmd, "cat") != 0) {
+        fprintf(stderr, usage, argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    long long from_ms = INT64_MIN, to_ms = INT64_MAX;
+    double lo = -INFINITY, hi = INFINITY;
+    for (int i = first_opt; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        int ok = v != NULL;
+        if (ok && strcmp(a, "--from") == 0) from_ms = atoll(v) * 1000LL;
+        else if (ok && strcmp(a, "--to") == 0) to_ms = atoll(v) * 1000LL;
+        else if (ok && strcmp(a, "--min") == 0) lo = atof(v);
+        else if (ok && strcmp(a, "--max") == 0) hi = atof(v);
+        else ok = 0;
+        if (!ok) { fprintf(stderr, usage, argv[0], argv[0], argv[0], argv[0]); return 1; }
+        i++;
+    }
+
+    ArchiveReader r;
+    if (!archive_reader_open(&r, path)) return 1;
+    int rc;
+    if (strcmp(cmd, "info") == 0) rc = archive_info(&r, path);
+    else if (strcmp(cmd, "cat") == 0) rc = archive_cat(&r, from_ms, to_ms);
+    else rc = archive_scan(&r, field, from_ms, to_ms, lo, hi);
+    archive_reader_close(&r);
+    return rc;
+}
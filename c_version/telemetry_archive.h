@@ -0,0 +1,395 @@
+/* telemetry_archive.h
+   Compressed columnar telemetry archive, written by the clients' --archive and read by
+   telemetry_archive. Header only, like motor_model.h.
+
+   Rows are cut into blocks of ARCHIVE_BLOCK_ROWS. Inside a block every column is its own
+   bitstream: timestamps as Gorilla delta-of-delta, each telemetry field as Gorilla XOR of
+   consecutive doubles. Both are lossless. An index at the end of the file holds each block's
+   time range and per field min/max, so a reader can skip blocks without touching them and
+   decode only the columns it needs.
+
+   Sensor noise fills the low mantissa bits, which XOR can't compress. A writer can be asked to
+   round values to a grid of 2^-fraction_bits first: the rounded values are exact doubles with
+   trailing zero bits, which the XOR coding then drops. -1 keeps values bit exact.
+
+   File layout, all integers little endian:
+     "MTA1" | block 0 | ... | index | index offset (u64) | block count (u32) | fraction bits (i32) | "MTA1"
+     block: ARCHIVE_COLUMNS bitstreams back to back, lengths in the index
+     index entry: offset u64, rows u32, t_first i64, t_last i64, min f64[5], max f64[5], bytes u32[6]
+*/
+
+#ifndef TELEMETRY_ARCHIVE_H
+#define TELEMETRY_ARCHIVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#define ARCHIVE_MAGIC "MTA1"
+#define ARCHIVE_FIELDS 5                     // gas, battery, speed, set point, temp
+#define ARCHIVE_COLUMNS (1 + ARCHIVE_FIELDS) // timestamp column first
+#define ARCHIVE_BLOCK_ROWS 1024
+#define ARCHIVE_INDEX_ENTRY_SIZE (8 + 4 + 8 + 8 + ARCHIVE_FIELDS * 16 + ARCHIVE_COLUMNS * 4)
+#define ARCHIVE_FOOTER_SIZE (8 + 4 + 4 + 4)
+
+typedef struct {
+    uint64_t offset;
+    uint32_t rows;
+    int64_t t_first, t_last;
+    double min[ARCHIVE_FIELDS], max[ARCHIVE_FIELDS];
+    uint32_t bytes[ARCHIVE_COLUMNS];
+} ArchiveBlockInfo;
+
+// Bitstreams, most significant bit first
+
+typedef struct {
+    unsigned char *buf;
+    size_t cap, bits;
+} BitWriter;
+
+static inline int bits_put(BitWriter *w, uint64_t value, int n) {
+    size_t need = (w->bits + n + 7) / 8 + 8;
+    if (need > w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 4096;
+        while (cap < need) cap *= 2;
+        unsigned char *grown = realloc(w->buf, cap);
+        if (!grown) return 0;
+        memset(grown + w->cap, 0, cap - w->cap);
+        w->buf = grown;
+        w->cap = cap;
+    }
+    if (n > 32) return bits_put(w, value >> 32, n - 32) && bits_put(w, value, 32);
+    // Shift the n bits to their position in a 64 bit window starting at the current byte
+    uint64_t x = (value & ((1ULL << n) - 1)) << (64 - (w->bits & 7) - n);
+    unsigned char *p = w->buf + (w->bits >> 3);
+    for (int i = 0; i < 8 && x; i++) p[i] |= (unsigned char)(x >> (56 - 8 * i));
+    w->bits += n;
+    return 1;
+}
+
+typedef struct {
+    const unsigned char *buf;
+    size_t bits, end;
+} BitReader;
+
+static inline uint64_t bits_get(BitReader *r, int n) {
+    if (n == 0) return 0;
+    if (n > 32) {
+        uint64_t hi = bits_get(r, n - 32);
+        return (hi << 32) | bits_get(r, 32);
+    }
+    // Load the 8 bytes from the current one, big endian, zeros past the end of the stream
+    size_t byte = r->bits >> 3, end = (r->end + 7) >> 3;
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) x = (x << 8) | (byte + i < end ? r->buf[byte + i] : 0);
+    uint64_t v = (x << (r->bits & 7)) >> (64 - n);
+    r->bits += n;
+    return v;
+}
+
+static inline uint64_t archive_double_bits(double d) { uint64_t u; memcpy(&u, &d, 8); return u; }
+static inline double archive_bits_double(uint64_t u) { double d; memcpy(&d, &u, 8); return d; }
+
+// Sign extends the low n bits
+static inline int64_t archive_sign_extend(uint64_t v, int n) {
+    uint64_t m = 1ULL << (n - 1);
+    return (int64_t)((v ^ m) - m);
+}
+
+// Column encoders. Timestamps: the first is stored raw, after that the change in delta, in the
+// smallest of five buckets. Telemetry rows come at a fixed interval, so nearly all take one bit.
+
+typedef struct {
+    int64_t prev, prev_delta;
+    int count;
+} TimestampEncoder;
+
+static inline int ts_encode(BitWriter *w, TimestampEncoder *e, int64_t t) {
+    int ok;
+    if (e->count == 0) {
+        ok = bits_put(w, (uint64_t)t, 64);
+    } else {
+        int64_t delta = t - e->prev;
+        int64_t dod = delta - e->prev_delta;
+        if (dod == 0) ok = bits_put(w, 0, 1);
+        else if (dod >= -64 && dod <= 63) ok = bits_put(w, 0x2, 2) && bits_put(w, (uint64_t)dod & 0x7F, 7);
+        else if (dod >= -256 && dod <= 255) ok = bits_put(w, 0x6, 3) && bits_put(w, (uint64_t)dod & 0x1FF, 9);
+        else if (dod >= -2048 && dod <= 2047) ok = bits_put(w, 0xE, 4) && bits_put(w, (uint64_t)dod & 0xFFF, 12);
+        else ok = bits_put(w, 0xF, 4) && bits_put(w, (uint64_t)dod, 64);
+        e->prev_delta = delta;
+    }
+    e->prev = t;
+    e->count++;
+    return ok;
+}
+
+static inline void ts_decode(BitReader *r, uint32_t rows, int64_t *out) {
+    int64_t prev = 0, delta = 0;
+    for (uint32_t i = 0; i < rows; i++) {
+        if (i == 0) {
+            prev = (int64_t)bits_get(r, 64);
+        } else {
+            int64_t dod;
+            if (bits_get(r, 1) == 0) dod = 0;
+            else if (bits_get(r, 1) == 0) dod = archive_sign_extend(bits_get(r, 7), 7);
+            else if (bits_get(r, 1) == 0) dod = archive_sign_extend(bits_get(r, 9), 9);
+            else if (bits_get(r, 1) == 0) dod = archive_sign_extend(bits_get(r, 12), 12);
+            else dod = (int64_t)bits_get(r, 64);
+            delta += dod;
+            prev += delta;
+        }
+        out[i] = prev;
+    }
+}
+
+// Floats: XOR with the previous value. An unchanged value takes one bit; otherwise only the
+// meaningful bits between the leading and trailing zeros are stored, reusing the previous
+// window when they fit in it.
+
+typedef struct {
+    uint64_t prev;
+    int leading, trailing; // previous window, leading = -1 before the first
+    int count;
+} FloatEncoder;
+
+static inline int float_encode(BitWriter *w, FloatEncoder *e, double d) {
+    uint64_t v = archive_double_bits(d);
+    int ok = 1;
+    if (e->count == 0) {
+        ok = bits_put(w, v, 64);
+        e->leading = -1;
+    } else {
+        uint64_t x = v ^ e->prev;
+        if (x == 0) {
+            ok = bits_put(w, 0, 1);
+        } else {
+            int leading = __builtin_clzll(x), trailing = __builtin_ctzll(x);
+            if (leading > 31) leading = 31; // 5 bit field
+            if (e->leading >= 0 && leading >= e->leading && trailing >= e->trailing) {
+                int len = 64 - e->leading - e->trailing;
+                ok = bits_put(w, 0x2, 2) && bits_put(w, x >> e->trailing, len);
+            } else {
+                int len = 64 - leading - trailing;
+                ok = bits_put(w, 0x3, 2) && bits_put(w, (uint64_t)leading, 5) &&
+                     bits_put(w, (uint64_t)(len & 63), 6) && bits_put(w, x >> trailing, len);
+                e->leading = leading;
+                e->trailing = trailing;
+            }
+        }
+    }
+    e->prev = v;
+    e->count++;
+    return ok;
+}
+
+static inline void float_decode(BitReader *r, uint32_t rows, double *out) {
+    uint64_t prev = 0;
+    int leading = 0, trailing = 0;
+    for (uint32_t i = 0; i < rows; i++) {
+        if (i == 0) {
+            prev = bits_get(r, 64);
+        } else if (bits_get(r, 1) == 1) {
+            if (bits_get(r, 1) == 1) {
+                leading = (int)bits_get(r, 5);
+                int len = (int)bits_get(r, 6);
+                if (len == 0) len = 64;
+                trailing = 64 - leading - len;
+            }
+            int len = 64 - leading - trailing;
+            prev ^= bits_get(r, len) << trailing;
+        }
+        out[i] = archive_bits_double(prev);
+    }
+}
+
+// Little endian helpers for the index and footer
+
+static inline void archive_put_u32(unsigned char *p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i)); }
+static inline void archive_put_u64(unsigned char *p, uint64_t v) { for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i)); }
+static inline uint32_t archive_get_u32(const unsigned char *p) { uint32_t v = 0; for (int i = 3; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+static inline uint64_t archive_get_u64(const unsigned char *p) { uint64_t v = 0; for (int i = 7; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+
+// Writer: append rows, close to flush the last block and write the index. Rows in time order
+// compress best, but the index keeps each block's earliest and latest timestamp either way.
+
+typedef struct {
+    FILE *f;
+    uint64_t offset;
+    BitWriter col[ARCHIVE_COLUMNS];
+    TimestampEncoder ts;
+    FloatEncoder fl[ARCHIVE_FIELDS];
+    ArchiveBlockInfo cur;
+    ArchiveBlockInfo *index;
+    int blocks, index_cap;
+    long long rows;
+    int fraction_bits; // -1 lossless
+} ArchiveWriter;
+
+static inline int archive_writer_open(ArchiveWriter *w, const char *path, int fraction_bits) {
+    memset(w, 0, sizeof(*w));
+    w->fraction_bits = fraction_bits < 0 ? -1 : fraction_bits;
+    w->f = fopen(path, "wb");
+    if (!w->f) { perror(path); return 0; }
+    if (fwrite(ARCHIVE_MAGIC, 1, 4, w->f) != 4) { fclose(w->f); return 0; }
+    w->offset = 4;
+    return 1;
+}
+
+static inline int archive_flush_block(ArchiveWriter *w) {
+    if (w->cur.rows == 0) return 1;
+    w->cur.offset = w->offset;
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++) {
+        size_t n = (w->col[c].bits + 7) / 8;
+        if (n && fwrite(w->col[c].buf, 1, n, w->f) != n) return 0;
+        w->cur.bytes[c] = (uint32_t)n;
+        w->offset += n;
+        memset(w->col[c].buf, 0, w->col[c].cap);
+        w->col[c].bits = 0;
+    }
+    if (w->blocks == w->index_cap) {
+        int cap = w->index_cap ? w->index_cap * 2 : 64;
+        ArchiveBlockInfo *grown = realloc(w->index, sizeof(ArchiveBlockInfo) * cap);
+        if (!grown) return 0;
+        w->index = grown;
+        w->index_cap = cap;
+    }
+    w->index[w->blocks++] = w->cur;
+    memset(&w->cur, 0, sizeof(w->cur));
+    memset(&w->ts, 0, sizeof(w->ts));
+    memset(w->fl, 0, sizeof(w->fl));
+    return 1;
+}
+
+static inline int archive_writer_append(ArchiveWriter *w, int64_t ts_ms, const double values[ARCHIVE_FIELDS]) {
+    double v[ARCHIVE_FIELDS];
+    for (int f = 0; f < ARCHIVE_FIELDS; f++) {
+        v[f] = w->fraction_bits < 0 ? values[f] : ldexp(round(ldexp(values[f], w->fraction_bits)), -w->fraction_bits);
+    }
+    ArchiveBlockInfo *b = &w->cur;
+    if (b->rows == 0) {
+        b->t_first = b->t_last = ts_ms;
+        for (int f = 0; f < ARCHIVE_FIELDS; f++) b->min[f] = b->max[f] = v[f];
+    }
+    if (ts_ms < b->t_first) b->t_first = ts_ms;
+    if (ts_ms > b->t_last) b->t_last = ts_ms;
+    if (!ts_encode(&w->col[0], &w->ts, ts_ms)) return 0;
+    for (int f = 0; f < ARCHIVE_FIELDS; f++) {
+        if (v[f] < b->min[f]) b->min[f] = v[f];
+        if (v[f] > b->max[f]) b->max[f] = v[f];
+        if (!float_encode(&w->col[1 + f], &w->fl[f], v[f])) return 0;
+    }
+    b->rows++;
+    w->rows++;
+    if (b->rows == ARCHIVE_BLOCK_ROWS) return archive_flush_block(w);
+    return 1;
+}
+
+static inline int archive_writer_close(ArchiveWriter *w) {
+    int ok = archive_flush_block(w);
+    uint64_t index_offset = w->offset;
+    unsigned char e[ARCHIVE_INDEX_ENTRY_SIZE];
+    for (int i = 0; ok && i < w->blocks; i++) {
+        const ArchiveBlockInfo *b = &w->index[i];
+        unsigned char *p = e;
+        archive_put_u64(p, b->offset); p += 8;
+        archive_put_u32(p, b->rows); p += 4;
+        archive_put_u64(p, (uint64_t)b->t_first); p += 8;
+        archive_put_u64(p, (uint64_t)b->t_last); p += 8;
+        for (int f = 0; f < ARCHIVE_FIELDS; f++) { archive_put_u64(p, archive_double_bits(b->min[f])); p += 8; }
+        for (int f = 0; f < ARCHIVE_FIELDS; f++) { archive_put_u64(p, archive_double_bits(b->max[f])); p += 8; }
+        for (int c = 0; c < ARCHIVE_COLUMNS; c++) { archive_put_u32(p, b->bytes[c]); p += 4; }
+        ok = fwrite(e, 1, sizeof(e), w->f) == sizeof(e);
+    }
+    unsigned char footer[ARCHIVE_FOOTER_SIZE];
+    archive_put_u64(footer, index_offset);
+    archive_put_u32(footer + 8, (uint32_t)w->blocks);
+    archive_put_u32(footer + 12, (uint32_t)w->fraction_bits);
+    memcpy(footer + 16, ARCHIVE_MAGIC, 4);
+    if (ok) ok = fwrite(footer, 1, sizeof(footer), w->f) == sizeof(footer);
+    if (fclose(w->f) != 0) ok = 0;
+    for (int c = 0; c < ARCHIVE_COLUMNS; c++) free(w->col[c].buf);
+    free(w->index);
+    return ok;
+}
+
+// Reader: loads the whole file, blocks are decoded on demand one column at a time
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    int blocks;
+    int fraction_bits;
+    ArchiveBlockInfo *index;
+} ArchiveReader;
+
+static inline int archive_reader_open(ArchiveReader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    FILE *f = fopen(path, "rb");
+    if (!f) { perror(path); return 0; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < 4 + ARCHIVE_FOOTER_SIZE) { fprintf(stderr, "%s: not an archive\n", path); fclose(f); return 0; }
+    r->data = malloc((size_t)size);
+    r->size = (size_t)size;
+    if (!r->data || fread(r->data, 1, r->size, f) != r->size) {
+        fprintf(stderr, "%s: read failed\n", path);
+        fclose(f);
+        free(r->data);
+        return 0;
+    }
+    fclose(f);
+
+    const unsigned char *footer = r->data + r->size - ARCHIVE_FOOTER_SIZE;
+    uint64_t index_offset = archive_get_u64(footer);
+    r->blocks = (int)archive_get_u32(footer + 8);
+    r->fraction_bits = (int32_t)archive_get_u32(footer + 12);
+    if (memcmp(r->data, ARCHIVE_MAGIC, 4) != 0 || memcmp(footer + 16, ARCHIVE_MAGIC, 4) != 0 ||
+        index_offset + (uint64_t)r->blocks * ARCHIVE_INDEX_ENTRY_SIZE + ARCHIVE_FOOTER_SIZE != r->size) {
+        fprintf(stderr, "%s: not an archive or truncated\n", path);
+        free(r->data);
+        return 0;
+    }
+
+    r->index = calloc(r->blocks ? r->blocks : 1, sizeof(ArchiveBlockInfo));
+    if (!r->index) { free(r->data); return 0; }
+    const unsigned char *p = r->data + index_offset;
+    for (int i = 0; i < r->blocks; i++) {
+        ArchiveBlockInfo *b = &r->index[i];
+        b->offset = archive_get_u64(p); p += 8;
+        b->rows = archive_get_u32(p); p += 4;
+        b->t_first = (int64_t)archive_get_u64(p); p += 8;
+        b->t_last = (int64_t)archive_get_u64(p); p += 8;
+        for (int f = 0; f < ARCHIVE_FIELDS; f++) { b->min[f] = archive_bits_double(archive_get_u64(p)); p += 8; }
+        for (int f = 0; f < ARCHIVE_FIELDS; f++) { b->max[f] = archive_bits_double(archive_get_u64(p)); p += 8; }
+        uint64_t end = b->offset;
+        for (int c = 0; c < ARCHIVE_COLUMNS; c++) { b->bytes[c] = archive_get_u32(p); p += 4; end += b->bytes[c]; }
+        if (b->rows > ARCHIVE_BLOCK_ROWS || end > index_offset) {
+            fprintf(stderr, "%s: corrupt block %d\n", path, i);
+            free(r->index);
+            free(r->data);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline void archive_reader_close(ArchiveReader *r) {
+    free(r->index);
+    free(r->data);
+}
+
+// Decodes one column of a block: column 0 into ts, column 1 + f into values. Returns the row count.
+static inline uint32_t archive_decode_column(const ArchiveReader *r, int block, int column, int64_t *ts, double *values) {
+    const ArchiveBlockInfo *b = &r->index[block];
+    uint64_t offset = b->offset;
+    for (int c = 0; c < column; c++) offset += b->bytes[c];
+    BitReader br = { r->data + offset, 0, (size_t)b->bytes[column] * 8 };
+    if (column == 0) ts_decode(&br, b->rows, ts);
+    else float_decode(&br, b->rows, values);
+    return b->rows;
+}
+
+#endif